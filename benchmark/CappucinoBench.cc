@@ -0,0 +1,587 @@
+// Micro benchmarks of the CappucinoCore kernels on analytic narrow bands, no Houdini needed.
+//
+// A sphere and a torus are sampled at every resolution and band width with their exact signed
+// distance, normal and closest point, so every run sees the same inputs and the numbers of two
+// plugin versions can be compared directly. Every kernel runs on fresh copies of the inputs,
+// the best of --repeat runs is reported. Progress goes to stderr, stdout only carries the JSON
+// (unless --out names a file for it), so the output can be redirected as it is.
+//
+// CappucinoBench [--res 64,128] [--band 3,6] [--repeat 3] [--threads 0] [--iterations 50]
+//                [--label name] [--out results.json]
+
+#include <ClosestPoint.h>
+#include <Convolve.h>
+#include <Diverge.h>
+#include <iWave.h>
+#include <iWaveKernel.h>
+#include <PressureProjection.h>
+#include <React.h>
+
+#include <openvdb/openvdb.h>
+#include <openvdb/util/NullInterrupter.h>
+#include <tbb/global_control.h>
+#include <tbb/task_arena.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace VdbCappucino;
+
+namespace {
+
+	typedef std::chrono::steady_clock Clock;
+
+	struct BenchOptions {
+		std::vector<int> resolutions;
+		std::vector<int> bands;
+		int repeats;
+		int threads;		// 0 for all cores
+		int iterations;		// PCG iteration limit of the pressure solves
+		std::string label;
+		std::string out;
+
+		BenchOptions() : repeats(3), threads(0), iterations(50)
+		{
+			resolutions.push_back(64);
+			resolutions.push_back(128);
+			bands.push_back(3);
+			bands.push_back(6);
+		}
+	};
+
+	struct BenchResult {
+		std::string kernel;
+		std::string shape;
+		int resolution;
+		int band;
+		openvdb::Index64 voxels;
+		double seconds;
+		int pcgIterations;	// -1 for the kernels without a solve
+		bool pcgSuccess;
+	};
+
+	/// Peak resident set size of the process so far in MB
+	double peakRssMB()
+	{
+#ifdef _WIN32
+		PROCESS_MEMORY_COUNTERS counters;
+		if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0.0;
+		return double(counters.PeakWorkingSetSize) / (1024.0 * 1024.0);
+#else
+		struct rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) != 0) return 0.0;
+#ifdef __APPLE__
+		return double(usage.ru_maxrss) / (1024.0 * 1024.0);	// bytes
+#else
+		return double(usage.ru_maxrss) / 1024.0;				// kilobytes
+#endif
+#endif
+	}
+
+	/// Best wall time of repeats runs. setup() builds fresh inputs before every run and is not timed.
+	template<typename SetupT, typename RunT>
+	double bestOf(int repeats, SetupT setup, RunT run)
+	{
+		double best = std::numeric_limits<double>::max();
+		for (int r = 0; r < repeats; ++r) {
+			setup();
+			const Clock::time_point start = Clock::now();
+			run();
+			best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
+		}
+		return best;
+	}
+
+	/// Surface with a closed form signed distance and outward normal
+	class Shape {
+	public:
+		virtual ~Shape() {}
+		virtual const char* name() const = 0;
+		virtual double distance(const openvdb::Vec3d& p, openvdb::Vec3d& normal) const = 0;
+	};
+
+	class Sphere : public Shape {
+	public:
+		explicit Sphere(double radius) : mRadius(radius) {}
+		const char* name() const { return "sphere"; }
+		double distance(const openvdb::Vec3d& p, openvdb::Vec3d& normal) const
+		{
+			const double length = p.length();
+			normal = length > 0.0 ? p / length : openvdb::Vec3d(0.0, 1.0, 0.0);
+			return length - mRadius;
+		}
+	private:
+		double mRadius;
+	};
+
+	/// Torus around the y axis. Unlike the sphere its curvature changes sign, which is where
+	/// the surface terms of the divergence and the Jacobian coupling do real work.
+	class Torus : public Shape {
+	public:
+		Torus(double major, double minor) : mMajor(major), mMinor(minor) {}
+		const char* name() const { return "torus"; }
+		double distance(const openvdb::Vec3d& p, openvdb::Vec3d& normal) const
+		{
+			const double rho = std::sqrt(p.x() * p.x() + p.z() * p.z());
+			const openvdb::Vec3d radial = rho > 0.0 ? openvdb::Vec3d(p.x() / rho, 0.0, p.z() / rho) : openvdb::Vec3d(1.0, 0.0, 0.0);
+			const double qx = rho - mMajor, qy = p.y();
+			const double length = std::sqrt(qx * qx + qy * qy);
+			normal = length > 0.0 ? (radial * qx + openvdb::Vec3d(0.0, qy, 0.0)) / length : radial;
+			return length - mMinor;
+		}
+	private:
+		double mMajor, mMinor;
+	};
+
+	/// Fields of one shape at one resolution in the [-1, 1]^3 domain. The surface fields reach
+	/// two voxels further than the band, so the samplers of the kernels never read background.
+	struct NarrowBand {
+		openvdb::FloatGrid::Ptr distance;
+		openvdb::Vec3SGrid::Ptr gradient;
+		openvdb::Vec3SGrid::Ptr cpt;		// world space closest points
+		openvdb::Vec3SGrid::Ptr velocity;	// rotation about the y axis, made tangential
+		openvdb::Vec3SGrid::Ptr exvel;		// rotation about the x axis, one voxel wider than the band
+		openvdb::Vec3SGrid::Ptr color;		// Gray-Scott u and v, v seeded on the upper half
+	};
+
+	NarrowBand buildNarrowBand(const Shape& shape, int resolution, int bandWidth)
+	{
+		const double voxelSize = 2.0 / resolution;
+		openvdb::math::Transform::Ptr transform = openvdb::math::Transform::createLinearTransform(voxelSize);
+
+		NarrowBand band;
+		band.distance = openvdb::FloatGrid::create(float((bandWidth + 3) * voxelSize));
+		band.gradient = openvdb::Vec3SGrid::create();
+		band.cpt = openvdb::Vec3SGrid::create();
+		band.velocity = openvdb::Vec3SGrid::create();
+		band.exvel = openvdb::Vec3SGrid::create();
+		band.color = openvdb::Vec3SGrid::create();
+		band.distance->setTransform(transform);
+		band.gradient->setTransform(transform);
+		band.cpt->setTransform(transform);
+		band.velocity->setTransform(transform);
+		band.exvel->setTransform(transform);
+		band.color->setTransform(transform);
+
+		openvdb::FloatGrid::Accessor distance = band.distance->getAccessor();
+		openvdb::Vec3SGrid::Accessor gradient = band.gradient->getAccessor();
+		openvdb::Vec3SGrid::Accessor cpt = band.cpt->getAccessor();
+		openvdb::Vec3SGrid::Accessor velocity = band.velocity->getAccessor();
+		openvdb::Vec3SGrid::Accessor exvel = band.exvel->getAccessor();
+		openvdb::Vec3SGrid::Accessor color = band.color->getAccessor();
+
+		const int half = resolution / 2;
+		for (int i = -half; i <= half; ++i) {
+			for (int j = -half; j <= half; ++j) {
+				for (int k = -half; k <= half; ++k) {
+					const openvdb::Coord ijk(i, j, k);
+					const openvdb::Vec3d p = transform->indexToWorld(ijk);
+					openvdb::Vec3d n;
+					const double d = shape.distance(p, n);
+					const double cells = std::fabs(d) / voxelSize;
+					if (cells > bandWidth + 2) continue;
+
+					distance.setValue(ijk, float(d));
+					gradient.setValue(ijk, openvdb::Vec3s(n));
+					cpt.setValue(ijk, openvdb::Vec3s(p - n * d));
+					if (cells > bandWidth + 1) continue;
+
+					exvel.setValue(ijk, openvdb::Vec3s(openvdb::Vec3d(0.0, -p.z(), p.y())));
+					if (cells > bandWidth) continue;
+
+					openvdb::Vec3d v(-p.z(), 0.0, p.x());
+					v -= n * v.dot(n);
+					velocity.setValue(ijk, openvdb::Vec3s(v));
+					color.setValue(ijk, p.y() > 0.0 ? openvdb::Vec3s(0.5f, 0.25f, 0.0f) : openvdb::Vec3s(1.0f, 0.0f, 0.0f));
+				}
+			}
+		}
+		return band;
+	}
+
+	/// Normalised Gaussian with a support of 5^3 voxels, it is rank-1 so every backend applies
+	openvdb::FloatGrid::Ptr gaussianKernel()
+	{
+		openvdb::FloatGrid::Ptr kernel = openvdb::FloatGrid::create();
+		openvdb::FloatGrid::Accessor accessor = kernel->getAccessor();
+		double sum = 0.0;
+		for (int pass = 0; pass < 2; ++pass) {
+			for (int i = -2; i <= 2; ++i)
+				for (int j = -2; j <= 2; ++j)
+					for (int k = -2; k <= 2; ++k) {
+						const double weight = std::exp(-0.5 * (i * i + j * j + k * k));
+						if (pass == 0) sum += weight;
+						else accessor.setValue(openvdb::Coord(i, j, k), float(weight / sum));
+					}
+		}
+		return kernel;
+	}
+
+	BenchResult makeResult(const std::string& kernel, const std::string& shape, int resolution, int band,
+		openvdb::Index64 voxels, double seconds)
+	{
+		BenchResult result;
+		result.kernel = kernel;
+		result.shape = shape;
+		result.resolution = resolution;
+		result.band = band;
+		result.voxels = voxels;
+		result.seconds = seconds;
+		result.pcgIterations = -1;
+		result.pcgSuccess = true;
+		return result;
+	}
+
+	void report(const BenchResult& result)
+	{
+		std::cerr << result.kernel << " " << result.shape << " res " << result.resolution << " band " << result.band
+			<< ": " << result.voxels << " voxels in " << result.seconds * 1000.0 << " ms, "
+			<< (result.seconds > 0.0 ? result.voxels / result.seconds : 0.0) << " voxels/s";
+		if (result.pcgIterations >= 0) {
+			std::cerr << ", " << result.pcgIterations << " PCG iterations" << (result.pcgSuccess ? "" : " (not converged)");
+		}
+		std::cerr << std::endl;
+	}
+
+	/// The kernel table and its tree only depend on the kernel size, not on a band
+	void benchmarkWaveKernel(const BenchOptions& options, std::vector<BenchResult>& results)
+	{
+		const int dims[] = { 6, 12 };
+		for (int d = 0; d < 2; ++d) {
+			iWaveKernelParms parms;
+			parms.sigma = 1.0f;
+			parms.dk = 0.01f;
+			parms.endk = 10.0f;
+			parms.dim = dims[d];
+			openvdb::FloatTree::Ptr tree;
+			// the table is built directly, the cache would hand out the first one after the first run
+			const double seconds = bestOf(options.repeats, [&]() { tree.reset(); }, [&]() {
+				iWaveKernelTable table(parms);
+				tree = buildKernelTree(table);
+			});
+			results.push_back(makeResult("wave_kernel", "cube", 2 * parms.dim, 0, tree->activeVoxelCount(), seconds));
+			report(results.back());
+		}
+	}
+
+	void benchmarkBand(const Shape& shape, int resolution, int bandWidth, const BenchOptions& options,
+		const openvdb::FloatGrid& convolveKernel, std::vector<BenchResult>& results)
+	{
+		const NarrowBand band = buildNarrowBand(shape, resolution, bandWidth);
+		const openvdb::Index64 voxels = band.velocity->activeVoxelCount();
+		const std::string shapeName = shape.name();
+		const int repeats = options.repeats;
+
+		openvdb::Vec3SGrid::Ptr grid, gridOld;
+		openvdb::FloatGrid::Ptr divergence;
+
+		// Gray-Scott, one step on a fresh copy of the color
+		{
+			GrayScottParms parms;
+			parms.feed = 0.07f;
+			parms.kill = 0.07f;
+			parms.delta = 1.0f;
+			parms.diffrate = 0.25f;
+			std::unique_ptr<GrayScottOp::LeafManagerT> leafManager;
+			const double seconds = bestOf(repeats, [&]() {
+				grid = band.color->deepCopy();
+				grid->tree().voxelizeActiveTiles();
+				leafManager.reset(new GrayScottOp::LeafManagerT(grid->tree(), 1));
+			}, [&]() { grayScottStep(*leafManager, parms); });
+			leafManager.reset();
+			results.push_back(makeResult("react", shapeName, resolution, bandWidth, voxels, seconds));
+			report(results.back());
+		}
+
+		// iWave, the three update modes of the wave SOP
+		{
+			const iWaveCoefficients coefficients(9.8f * 0.04f * 0.04f, 0.3f * 0.04f);
+			iWaveKernelParms kernelParms;
+			kernelParms.sigma = 1.0f;
+			kernelParms.dk = 0.01f;
+			kernelParms.endk = 10.0f;
+			kernelParms.dim = 6;
+			const iWaveKernelTable::ConstPtr table = iWaveKernelCache::get(kernelParms);
+			const char* names[] = { "wave_copy", "wave_rotate", "wave_integrated" };
+			for (int mode = IWAVE_COPY; mode <= IWAVE_INTEGRATED; ++mode) {
+				const double seconds = bestOf(repeats, [&]() {
+					grid = band.velocity->deepCopy();
+					gridOld = band.velocity->deepCopy();
+				}, [&]() {
+					switch (mode) {
+					case IWAVE_COPY: {
+						// as the SOP does it, the copy of the new heights becomes the previous grid
+						openvdb::Vec3SGrid::Ptr buffer = grid->deepCopy();
+						copyHeights(*grid, *gridOld, *band.exvel, coefficients);
+						gridOld->setTree(buffer->treePtr());
+						break;
+					}
+					case IWAVE_ROTATE:
+						rotateHeights(*grid, *gridOld, *band.exvel, coefficients);
+						break;
+					default:
+						integratedHeights(*grid, *gridOld, *table, coefficients);
+						break;
+					}
+				});
+				results.push_back(makeResult(names[mode], shapeName, resolution, bandWidth, voxels, seconds));
+				report(results.back());
+			}
+		}
+
+		// convolution with every backend, the convolvers are set up outside the timing
+		{
+			const DenseKernel dense(convolveKernel);
+			const char* names[] = { "convolve_reference", "convolve_brick", "convolve_separable", "convolve_fft" };
+			for (int backend = CONVOLVE_REFERENCE; backend <= CONVOLVE_FFT; ++backend) {
+				std::unique_ptr<BrickConvolver> convolver;
+				if (backend != CONVOLVE_REFERENCE) convolver.reset(new BrickConvolver(dense, ConvolveBackend(backend)));
+				const double seconds = bestOf(repeats, [&]() { grid = band.color->deepCopy(); }, [&]() {
+					if (convolver) convolveBricks(*grid, *convolver);
+					else convolveReference(*grid, convolveKernel);
+				});
+				results.push_back(makeResult(names[backend], shapeName, resolution, bandWidth, voxels, seconds));
+				report(results.back());
+			}
+		}
+
+		// closest point extension of the velocity, including the band update
+		{
+			const double seconds = bestOf(repeats, [&]() { grid = band.velocity->deepCopy(); }, [&]() {
+				closestPointExtend(*grid, *band.cpt, *band.distance, CPT_BOX, true, float(bandWidth), true);
+			});
+			results.push_back(makeResult("cpt", shapeName, resolution, bandWidth, voxels, seconds));
+			report(results.back());
+		}
+
+		// tangential divergence
+		{
+			const double seconds = bestOf(repeats, [&]() { divergence = openvdb::FloatGrid::create(*band.velocity); }, [&]() {
+				tangentialDivergence(*band.velocity, *band.gradient, *divergence);
+			});
+			results.push_back(makeResult("divergence", shapeName, resolution, bandWidth, voxels, seconds));
+			report(results.back());
+		}
+
+		// Jacobian coupling of the external velocity
+		{
+			const double seconds = bestOf(repeats, [&]() { grid = band.velocity->deepCopy(); }, [&]() {
+				applyJacobianCoupling(*grid, *band.exvel);
+			});
+			results.push_back(makeResult("coupling", shapeName, resolution, bandWidth, voxels, seconds));
+			report(results.back());
+		}
+
+		// projection onto the tangent plane, the gradient is sampled through the aligned path
+		{
+			const double seconds = bestOf(repeats, [&]() { grid = band.velocity->deepCopy(); }, [&]() {
+				forEachLeafWithField<ProjectVectorOp>(*grid, *band.gradient, SAMPLER_QUADRATIC, true);
+			});
+			results.push_back(makeResult("projection", shapeName, resolution, bandWidth, voxels, seconds));
+			report(results.back());
+		}
+
+		// cold pressure solves: assembly, preconditioner and PCG from a zero guess
+		{
+			struct Variant {
+				const char* name;
+				int preconditioner;
+				bool matrixFree;
+				bool mixedPrecision;
+			};
+			const Variant variants[] = {
+				{ "pressure_jacobi", PRECONDITIONER_JACOBI, false, false },
+				{ "pressure_multigrid", PRECONDITIONER_MULTIGRID, false, false },
+				{ "pressure_matrixfree", PRECONDITIONER_JACOBI, true, false },
+				{ "pressure_mixed", PRECONDITIONER_JACOBI, true, true }
+			};
+			openvdb::util::NullInterrupter interrupter;
+			for (const Variant& variant : variants) {
+				PressureSolveParms parms;
+				parms.iterations = options.iterations;
+				parms.laplacianMode = LAPLACIAN_SURFACE;
+				parms.preconditionerMode = variant.preconditioner;
+				parms.matrixFree = variant.matrixFree;
+				parms.mixedPrecision = variant.mixedPrecision;
+
+				std::unique_ptr<PressureMatrixCache> cache;
+				PressureVector x;
+				openvdb::math::pcg::State state;
+				bool fallback = false;
+				const double seconds = bestOf(repeats, [&]() {
+					grid = band.velocity->deepCopy();
+					divergence = openvdb::FloatGrid::create(*grid);
+					surfaceDivergence(*grid, *band.gradient, NULL, *divergence);
+					cache.reset(new PressureMatrixCache());
+					x = PressureVector();
+				}, [&]() {
+					state = solvePressure(*grid, *band.gradient, *divergence, parms, *cache, fallback, NULL, x, interrupter);
+				});
+				BenchResult result = makeResult(variant.name, shapeName, resolution, bandWidth, voxels, seconds);
+				result.pcgIterations = state.iterations;
+				result.pcgSuccess = state.success;
+				results.push_back(result);
+				report(results.back());
+			}
+		}
+	}
+
+	/// The text as the contents of a JSON string literal
+	std::string jsonEscape(const std::string& text)
+	{
+		std::ostringstream escaped;
+		for (std::string::const_iterator c = text.begin(); c != text.end(); ++c) {
+			switch (*c) {
+			case '"': escaped << "\\\""; break;
+			case '\\': escaped << "\\\\"; break;
+			case '\n': escaped << "\\n"; break;
+			case '\r': escaped << "\\r"; break;
+			case '\t': escaped << "\\t"; break;
+			default:
+				if ((unsigned char)(*c) < 0x20) {
+					static const char* hex = "0123456789abcdef";
+					escaped << "\\u00" << hex[(*c >> 4) & 0xf] << hex[*c & 0xf];
+				}
+				else {
+					escaped << *c;
+				}
+				break;
+			}
+		}
+		return escaped.str();
+	}
+
+	/// The peak RSS is the high-water mark of the whole process, so it is reported once per run
+	/// instead of per kernel, where it would only repeat the largest peak so far.
+	std::string toJson(const std::vector<BenchResult>& results, const BenchOptions& options, int threads, double peakRss)
+	{
+		std::ostringstream json;
+		json.precision(9);
+		json << "{\n";
+		json << "  \"label\": \"" << jsonEscape(options.label) << "\",\n";
+		json << "  \"openvdb\": \"" << OPENVDB_LIBRARY_MAJOR_VERSION << "." << OPENVDB_LIBRARY_MINOR_VERSION << "."
+			<< OPENVDB_LIBRARY_PATCH_VERSION << "\",\n";
+		json << "  \"threads\": " << threads << ",\n";
+		json << "  \"repeats\": " << options.repeats << ",\n";
+		json << "  \"peak_rss_mb\": " << peakRss << ",\n";
+		json << "  \"results\": [";
+		for (size_t i = 0; i < results.size(); ++i) {
+			const BenchResult& result = results[i];
+			json << (i ? ",\n" : "\n") << "    {"
+				<< "\"kernel\": \"" << result.kernel << "\", "
+				<< "\"shape\": \"" << result.shape << "\", "
+				<< "\"resolution\": " << result.resolution << ", "
+				<< "\"band\": " << result.band << ", "
+				<< "\"voxels\": " << result.voxels << ", "
+				<< "\"seconds\": " << result.seconds << ", "
+				<< "\"voxels_per_second\": " << (result.seconds > 0.0 ? result.voxels / result.seconds : 0.0);
+			if (result.pcgIterations >= 0) {
+				json << ", \"pcg_iterations\": " << result.pcgIterations
+					<< ", \"pcg_success\": " << (result.pcgSuccess ? "true" : "false");
+			}
+			json << "}";
+		}
+		json << "\n  ]\n}\n";
+		return json.str();
+	}
+
+	std::vector<int> parseList(const char* text)
+	{
+		std::vector<int> values;
+		std::stringstream stream(text);
+		std::string item;
+		while (std::getline(stream, item, ',')) {
+			const int value = std::atoi(item.c_str());
+			if (value > 0) values.push_back(value);
+		}
+		return values;
+	}
+
+	bool parseOptions(int argc, char** argv, BenchOptions& options)
+	{
+		for (int i = 1; i < argc; ++i) {
+			const char* arg = argv[i];
+			const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+			if (!value) return false;
+			if (!std::strcmp(arg, "--res")) options.resolutions = parseList(value);
+			else if (!std::strcmp(arg, "--band")) options.bands = parseList(value);
+			else if (!std::strcmp(arg, "--repeat")) options.repeats = std::max(1, std::atoi(value));
+			else if (!std::strcmp(arg, "--threads")) options.threads = std::max(0, std::atoi(value));
+			else if (!std::strcmp(arg, "--iterations")) options.iterations = std::max(1, std::atoi(value));
+			else if (!std::strcmp(arg, "--label")) options.label = value;
+			else if (!std::strcmp(arg, "--out")) options.out = value;
+			else return false;
+			++i;
+		}
+		return !options.resolutions.empty() && !options.bands.empty();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+	if (!parseOptions(argc, argv, options)) {
+		std::cerr << "usage: " << argv[0] << " [--res 64,128] [--band 3,6] [--repeat 3] [--threads 0]"
+			<< " [--iterations 50] [--label name] [--out results.json]" << std::endl;
+		return 1;
+	}
+
+	openvdb::initialize();
+
+	std::unique_ptr<tbb::global_control> threadLimit;
+	if (options.threads > 0) {
+		threadLimit.reset(new tbb::global_control(tbb::global_control::max_allowed_parallelism, options.threads));
+	}
+	const int threads = options.threads > 0 ? std::min(options.threads, tbb::this_task_arena::max_concurrency())
+		: tbb::this_task_arena::max_concurrency();
+	std::cerr << "Cappucino kernel benchmark, " << threads << " threads" << std::endl;
+
+	std::vector<BenchResult> results;
+	benchmarkWaveKernel(options, results);
+
+	const openvdb::FloatGrid::Ptr convolveKernel = gaussianKernel();
+	const Sphere sphere(0.7);
+	const Torus torus(0.6, 0.25);
+	const Shape* shapes[] = { &sphere, &torus };
+	for (const Shape* shape : shapes) {
+		for (int resolution : options.resolutions) {
+			for (int bandWidth : options.bands) {
+				benchmarkBand(*shape, resolution, bandWidth, options, *convolveKernel, results);
+			}
+		}
+	}
+
+	const double peakRss = peakRssMB();
+	std::cerr << "peak RSS " << peakRss << " MB" << std::endl;
+	const std::string json = toJson(results, options, threads, peakRss);
+	if (options.out.empty()) {
+		std::cout << json;
+	}
+	else {
+		std::ofstream file(options.out.c_str());
+		if (!file) {
+			std::cerr << "cannot write " << options.out << std::endl;
+			return 1;
+		}
+		file << json;
+	}
+	return 0;
+}
@@ -0,0 +1,211 @@
+#pragma once
+#include <openvdb/openvdb.h>
+#include <openvdb/tree/LeafManager.h>
+#include <openvdb/tools/Interpolation.h>
+#include <openvdb/tools/Prune.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+#include <vector>
+
+namespace VdbCappucino {
+
+	// interpolation of the extended field, the order matches the "interpolationmethod" menu of VDB CPT
+	enum CptInterpolation {
+		CPT_NEAREST = 0,
+		CPT_BOX,
+		CPT_SPLINE
+	};
+
+	/// First half of the band rebuild: collects the voxels of the grid's index space that the active
+	/// voxels of the distance grid put within maxCells of the surface. Leaves the moving surface
+	/// reached since the last pass are part of it, see activateClosestPointBand.
+	class ClosestPointActivateOp {
+	public:
+		typedef openvdb::tree::LeafManager<const openvdb::FloatTree> LeafManagerT;
+
+		ClosestPointActivateOp(const openvdb::math::Transform& transform, const openvdb::FloatGrid& distance, float maxCells) :
+			mTransform(&transform), mDistance(&distance), mMaxDistance(maxCells * transform.voxelSize().x()), mBand(false) {}
+
+		ClosestPointActivateOp(const ClosestPointActivateOp& other, tbb::split) :
+			mTransform(other.mTransform), mDistance(other.mDistance), mMaxDistance(other.mMaxDistance), mBand(false) {}
+
+		void operator()(const LeafManagerT::LeafRange& range)
+		{
+			const openvdb::math::Transform& distanceTransform = mDistance->transform();
+			const bool aligned = distanceTransform == *mTransform;
+			openvdb::tree::ValueAccessor<openvdb::BoolTree> band(mBand);
+			for (LeafManagerT::LeafRange::Iterator leafIter = range.begin(); leafIter; ++leafIter) {
+				for (openvdb::FloatTree::LeafNodeType::ValueOnCIter iter = leafIter->cbeginValueOn(); iter; ++iter) {
+					if (std::fabs(*iter) > mMaxDistance) continue;
+					band.setValueOn(aligned ? iter.getCoord() :
+						mTransform->worldToIndexNodeCentered(distanceTransform.indexToWorld(iter.getCoord())));
+				}
+			}
+		}
+
+		void join(ClosestPointActivateOp& other) { mBand.topologyUnion(other.mBand); }
+
+		const openvdb::BoolTree& band() const { return mBand; }
+
+	private:
+		const openvdb::math::Transform* mTransform;
+		const openvdb::FloatGrid* mDistance;
+		double mMaxDistance;
+		openvdb::BoolTree mBand;
+	};
+
+	/// Switches on every voxel of grid within maxCells of the surface, adding the leaves that are
+	/// missing. Together with ClosestPointBandOp the active mask is rebuilt from the distance grid,
+	/// so the band follows a moving surface instead of only ever shrinking.
+	inline void activateClosestPointBand(openvdb::Vec3SGrid& grid, const openvdb::FloatGrid& distance, float maxCells)
+	{
+		ClosestPointActivateOp::LeafManagerT leafManager(distance.tree());
+		ClosestPointActivateOp op(grid.transform(), distance, maxCells);
+		tbb::parallel_reduce(leafManager.leafRange(), op);
+		grid.tree().topologyUnion(op.band());
+	}
+
+	/// Second half of the band rebuild: computes the new active state of every leaf, the active
+	/// voxels within maxCells of the surface. The distance is sampled at the voxel itself, so
+	/// unaligned distance grids are handled as well. The grid is not touched, so the extension
+	/// still samples the field as it was before the band update.
+	class ClosestPointBandOp {
+	public:
+		typedef openvdb::Vec3STree TreeT;
+		typedef TreeT::LeafNodeType LeafT;
+		typedef LeafT::NodeMaskType MaskT;
+		typedef openvdb::tree::LeafManager<TreeT> LeafManagerT;
+
+		ClosestPointBandOp(const openvdb::math::Transform& transform, const openvdb::FloatGrid& distance, float maxCells,
+			std::vector<MaskT>& masks) :
+			mTransform(&transform), mDistance(&distance), mMaxDistance(maxCells * transform.voxelSize().x()), mMasks(&masks) {}
+
+		void operator()(const LeafManagerT::LeafRange& range) const
+		{
+			typedef openvdb::FloatGrid::ConstAccessor FloatAccessor;
+			FloatAccessor distanceAccessor = mDistance->getConstAccessor();
+			openvdb::tools::GridSampler<FloatAccessor, openvdb::tools::BoxSampler> distanceSampler(distanceAccessor, mDistance->transform());
+
+			for (LeafManagerT::LeafRange::Iterator leafIter = range.begin(); leafIter; ++leafIter) {
+				const LeafT& leaf = *leafIter;
+				MaskT& mask = (*mMasks)[leafIter.pos()];
+				mask = leaf.getValueMask();
+				for (LeafT::ValueOnCIter iter = leaf.cbeginValueOn(); iter; ++iter) {
+					const openvdb::Vec3d position = mTransform->indexToWorld(iter.getCoord());
+					if (std::fabs(distanceSampler.wsSample(position)) > mMaxDistance) mask.setOff(iter.pos());
+				}
+			}
+		}
+
+	private:
+		const openvdb::math::Transform* mTransform;
+		const openvdb::FloatGrid* mDistance;
+		double mMaxDistance;
+		std::vector<MaskT>* mMasks;
+	};
+
+	/// Hands the band computed by ClosestPointBandOp to the leaves
+	class ApplyLeafMaskOp {
+	public:
+		typedef openvdb::Vec3STree::LeafNodeType LeafT;
+
+		explicit ApplyLeafMaskOp(const std::vector<LeafT::NodeMaskType>& masks) : mMasks(&masks) {}
+
+		void operator()(LeafT& leaf, size_t leafIdx) const { leaf.setValueMask((*mMasks)[leafIdx]); }
+
+	private:
+		const std::vector<LeafT::NodeMaskType>* mMasks;
+	};
+
+	/// Closest point method extension of a vector field. Every voxel of the band takes the value of
+	/// the field at its closest point (or the offset to the closest point in world coordinates mode),
+	/// the active voxels outside the band are zeroed. The field is sampled with SamplerT, which is
+	/// fixed at compile time, and every task sets up its accessors and samplers once for a whole
+	/// range of leaves. The new values go into auxiliary buffer 1, so the source leaves stay
+	/// untouched while other tasks still sample them.
+	template<typename SamplerT>
+	class ClosestPointExtendOp {
+	public:
+		typedef openvdb::Vec3STree TreeT;
+		typedef TreeT::LeafNodeType LeafT;
+		typedef LeafT::NodeMaskType MaskT;
+		typedef openvdb::tree::LeafManager<TreeT> LeafManagerT;
+
+		ClosestPointExtendOp(const LeafManagerT& leafManager, const openvdb::math::Transform& transform,
+			const openvdb::Vec3SGrid& cpt, bool worldCoords, const std::vector<MaskT>& band) :
+			mTree(&leafManager.tree()), mTransform(&transform), mCpt(&cpt), mWorldCoords(worldCoords), mBand(&band) {}
+
+		void operator()(const typename LeafManagerT::LeafRange& range) const
+		{
+			typedef openvdb::Vec3SGrid::ConstAccessor VectorAccessor;
+
+			VectorAccessor fieldAccessor(*mTree);
+			VectorAccessor cptAccessor = mCpt->getConstAccessor();
+			openvdb::tools::GridSampler<VectorAccessor, SamplerT> fieldSampler(fieldAccessor, *mTransform);
+			openvdb::tools::GridSampler<VectorAccessor, openvdb::tools::BoxSampler> cptSampler(cptAccessor, mCpt->transform());
+
+			for (typename LeafManagerT::LeafRange::Iterator leafIter = range.begin(); leafIter; ++leafIter) {
+				const LeafT& leaf = *leafIter;
+				const MaskT& band = (*mBand)[leafIter.pos()];
+				typename LeafT::Buffer& result = leafIter.buffer(1);
+				for (typename LeafT::ValueOnCIter iter = leaf.cbeginValueOn(); iter; ++iter) {
+					const openvdb::Index n = iter.pos();
+					if (!band.isOn(n)) {
+						result.setValue(n, openvdb::Vec3f(0, 0, 0));
+						continue;
+					}
+					const openvdb::Vec3d position = mTransform->indexToWorld(iter.getCoord());
+					const openvdb::Vec3f closestPoint = cptSampler.wsSample(position);
+					if (mWorldCoords) result.setValue(n, closestPoint - position);
+					else result.setValue(n, fieldSampler.wsSample(closestPoint));
+				}
+			}
+		}
+
+	private:
+		const TreeT* mTree;
+		const openvdb::math::Transform* mTransform;
+		const openvdb::Vec3SGrid* mCpt;
+		bool mWorldCoords;
+		const std::vector<MaskT>* mBand;
+	};
+
+	template<typename SamplerT>
+	inline void closestPointExtend(openvdb::tree::LeafManager<openvdb::Vec3STree>& leafManager, const openvdb::math::Transform& transform,
+		const openvdb::Vec3SGrid& cpt, bool worldCoords, const std::vector<ClosestPointBandOp::MaskT>& band)
+	{
+		tbb::parallel_for(leafManager.leafRange(), ClosestPointExtendOp<SamplerT>(leafManager, transform, cpt, worldCoords, band));
+	}
+
+	/// Extends grid along the closest points of cpt within maxCells of the surface, the sampler
+	/// is picked once for the whole grid. The band is rebuilt from the distance grid first, so the
+	/// extension runs over exactly the voxels of the new band, but it samples the field before the
+	/// voxels outside the band are zeroed. With pruning the leaves that end up empty are dropped afterwards, so the tree
+	/// only ever holds the current band.
+	inline void closestPointExtend(openvdb::Vec3SGrid& grid, const openvdb::Vec3SGrid& cpt,
+		const openvdb::FloatGrid& distance, int interpolation, bool worldCoords, float maxCells, bool prune)
+	{
+		activateClosestPointBand(grid, distance, maxCells);
+		// the band is processed leaf by leaf, active tiles would be skipped
+		grid.tree().voxelizeActiveTiles();
+
+		ClosestPointBandOp::LeafManagerT leafManager(grid.tree(), 1);
+		std::vector<ClosestPointBandOp::MaskT> band(leafManager.leafCount());
+		tbb::parallel_for(leafManager.leafRange(), ClosestPointBandOp(grid.transform(), distance, maxCells, band));
+
+		switch (interpolation) {
+		case CPT_NEAREST:
+			closestPointExtend<openvdb::tools::PointSampler>(leafManager, grid.transform(), cpt, worldCoords, band);
+			break;
+		case CPT_BOX:
+			closestPointExtend<openvdb::tools::BoxSampler>(leafManager, grid.transform(), cpt, worldCoords, band);
+			break;
+		default:
+			closestPointExtend<openvdb::tools::QuadraticSampler>(leafManager, grid.transform(), cpt, worldCoords, band);
+			break;
+		}
+		leafManager.swapLeafBuffer(1);
+		leafManager.foreach(ApplyLeafMaskOp(band));
+		if (prune) openvdb::tools::pruneInactive(grid.tree());
+	}
+}
@@ -0,0 +1,445 @@
+#pragma once
+#include <openvdb/openvdb.h>
+#include <openvdb/tree/LeafManager.h>
+#include <tbb/parallel_for.h>
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <vector>
+
+namespace VdbCappucino {
+
+	// backends of SOP_VdbConvolve, the order matches the "backend" menu
+	enum ConvolveBackend {
+		CONVOLVE_REFERENCE = 0,	// per voxel walk over the sparse kernel grid
+		CONVOLVE_BRICK,			// dense tap loop over a leaf brick
+		CONVOLVE_SEPARABLE,		// three 1D passes, needs a rank-1 kernel
+		CONVOLVE_FFT			// zero padded FFT per leaf brick
+	};
+
+	/// Active taps of a sparse kernel grid in the order of its active values. An active tile
+	/// contributes one tap per voxel it covers, so a pruned constant kernel keeps all of its taps.
+	inline void kernelTaps(const openvdb::FloatGrid& kernel, std::vector<openvdb::Coord>& offsets, std::vector<float>& weights)
+	{
+		for (openvdb::FloatGrid::ValueOnCIter it = kernel.cbeginValueOn(); it; ++it) {
+			openvdb::CoordBBox bbox;
+			it.getBoundingBox(bbox);
+			for (int i = bbox.min().x(); i <= bbox.max().x(); ++i)
+				for (int j = bbox.min().y(); j <= bbox.max().y(); ++j)
+					for (int k = bbox.min().z(); k <= bbox.max().z(); ++k) {
+						offsets.push_back(openvdb::Coord(i, j, k));
+						weights.push_back(it.getValue());
+					}
+		}
+	}
+
+	/// Dense copy of the active taps of a sparse kernel grid, see kernelTaps.
+	/// If the kernel is rank-1 (k(i,j,k) = fx(i)*fy(j)*fz(k)) the factors are stored as well.
+	class DenseKernel {
+	public:
+		struct Tap {
+			int i, j, k;	// offset relative to min()
+			float weight;
+		};
+
+		explicit DenseKernel(const openvdb::FloatGrid& kernel) : mSeparable(false)
+		{
+			openvdb::CoordBBox bbox;
+			if (!kernel.tree().evalActiveVoxelBoundingBox(bbox)) {
+				bbox = openvdb::CoordBBox(openvdb::Coord(0), openvdb::Coord(0));
+			}
+			mMin = bbox.min();
+			mDim = bbox.dim();
+			mDense.assign(size_t(mDim[0]) * mDim[1] * mDim[2], 0.0f);
+			std::vector<openvdb::Coord> offsets;
+			std::vector<float> weights;
+			kernelTaps(kernel, offsets, weights);
+			for (size_t t = 0; t < offsets.size(); ++t) {
+				const openvdb::Coord u = offsets[t] - mMin;
+				mDense[index(u[0], u[1], u[2])] = weights[t];
+			}
+			init();
+		}
+
+		/// kernel given as a dense x major array of dim^3 taps starting at min
+		DenseKernel(const openvdb::Coord& min, const openvdb::Coord& dim, const std::vector<float>& values) :
+			mMin(min), mDim(dim), mDense(values), mSeparable(false)
+		{
+			init();
+		}
+
+		const openvdb::Coord& min() const { return mMin; }
+		const openvdb::Coord& dim() const { return mDim; }
+		const std::vector<Tap>& taps() const { return mTaps; }
+		float value(int i, int j, int k) const { return mDense[index(i, j, k)]; }
+
+		bool isSeparable() const { return mSeparable; }
+		const std::vector<float>& factor(int axis) const { return mFactor[axis]; }
+
+	private:
+		size_t index(int i, int j, int k) const { return (size_t(i) * mDim[1] + j) * mDim[2] + k; }
+
+		void init()
+		{
+			for (int i = 0; i < mDim[0]; ++i)
+				for (int j = 0; j < mDim[1]; ++j)
+					for (int k = 0; k < mDim[2]; ++k) {
+						const float w = mDense[index(i, j, k)];
+						if (w != 0.0f) {
+							Tap tap = { i, j, k, w };
+							mTaps.push_back(tap);
+						}
+					}
+			factorize();
+		}
+
+		// rank-1 test: factor through the largest tap and check the reconstruction
+		void factorize()
+		{
+			if (mTaps.empty()) return;
+			const Tap* pivot = &mTaps[0];
+			for (size_t n = 1; n < mTaps.size(); ++n) {
+				if (std::fabs(mTaps[n].weight) > std::fabs(pivot->weight)) pivot = &mTaps[n];
+			}
+			const float p = pivot->weight;
+			for (int a = 0; a < 3; ++a) mFactor[a].assign(mDim[a], 0.0f);
+			for (int i = 0; i < mDim[0]; ++i) mFactor[0][i] = value(i, pivot->j, pivot->k);
+			for (int j = 0; j < mDim[1]; ++j) mFactor[1][j] = value(pivot->i, j, pivot->k) / p;
+			for (int k = 0; k < mDim[2]; ++k) mFactor[2][k] = value(pivot->i, pivot->j, k) / p;
+
+			const float tolerance = 1.0e-5f * std::fabs(p);
+			for (int i = 0; i < mDim[0]; ++i)
+				for (int j = 0; j < mDim[1]; ++j)
+					for (int k = 0; k < mDim[2]; ++k) {
+						const float rank1 = mFactor[0][i] * mFactor[1][j] * mFactor[2][k];
+						if (std::fabs(rank1 - value(i, j, k)) > tolerance) return;
+					}
+			mSeparable = true;
+		}
+
+		openvdb::Coord mMin, mDim;
+		std::vector<float> mDense;
+		std::vector<Tap> mTaps;
+		std::vector<float> mFactor[3];
+		bool mSeparable;
+	};
+
+	/// Per thread scratch memory of a BrickConvolver, reused from leaf to leaf.
+	struct ConvolveScratch {
+		std::vector<float> brick[3];
+		std::vector<float> pass[3];
+		std::vector<std::complex<float> > spectrum[2];
+		float result[3][512];
+	};
+
+	namespace internal {
+		inline int nextPow2(int n) { int p = 1; while (p < n) p <<= 1; return p; }
+
+		// in place radix-2 FFT of n values spaced by stride, twiddle[k] = exp(-2 pi i k / n)
+		inline void fft1d(std::complex<float>* data, int n, int stride,
+			const std::complex<float>* twiddle, bool inverse)
+		{
+			for (int i = 1, j = 0; i < n; ++i) {
+				int bit = n >> 1;
+				for (; j & bit; bit >>= 1) j ^= bit;
+				j ^= bit;
+				if (i < j) std::swap(data[i * stride], data[j * stride]);
+			}
+			for (int len = 2; len <= n; len <<= 1) {
+				const int half = len >> 1;
+				const int step = n / len;
+				for (int i = 0; i < n; i += len) {
+					for (int k = 0; k < half; ++k) {
+						const std::complex<float> w = inverse ? std::conj(twiddle[k * step]) : twiddle[k * step];
+						std::complex<float>& a = data[(i + k) * stride];
+						std::complex<float>& b = data[(i + k + half) * stride];
+						const std::complex<float> t = b * w;
+						b = a - t;
+						a += t;
+					}
+				}
+			}
+		}
+	}
+
+	/// Convolves one leaf at a time: the leaf and its kernel halo are densified into a
+	/// brick which is then filtered by a dense tap loop, separable passes or an FFT.
+	/// Same correlation as the reference path: out(x) = sum_t k(t) * in(x + t).
+	class BrickConvolver {
+	public:
+		typedef openvdb::Vec3SGrid::TreeType::LeafNodeType LeafT;
+		static const int LEAF_DIM = LeafT::DIM;
+
+		BrickConvolver(const DenseKernel& kernel, ConvolveBackend backend) : mKernel(kernel), mBackend(backend)
+		{
+			if (mBackend == CONVOLVE_SEPARABLE && !mKernel.isSeparable()) mBackend = CONVOLVE_BRICK;
+			for (int a = 0; a < 3; ++a) mBrickDim[a] = LEAF_DIM + mKernel.dim()[a] - 1;
+			if (mBackend == CONVOLVE_FFT) initSpectrum();
+		}
+
+		ConvolveBackend backend() const { return mBackend; }
+
+		/// copy the leaf at origin and its halo into the brick of the scratch
+		template<typename AccessorT>
+		void gather(AccessorT& acc, const openvdb::Coord& origin, ConvolveScratch& s) const
+		{
+			const openvdb::Coord lo = origin + mKernel.min();
+			const size_t count = size_t(mBrickDim[0]) * mBrickDim[1] * mBrickDim[2];
+			for (int c = 0; c < 3; ++c) s.brick[c].resize(count);
+			float* b0 = &s.brick[0][0];
+			float* b1 = &s.brick[1][0];
+			float* b2 = &s.brick[2][0];
+			openvdb::Coord ijk;
+			size_t n = 0;
+			for (int i = 0; i < mBrickDim[0]; ++i) {
+				ijk[0] = lo[0] + i;
+				for (int j = 0; j < mBrickDim[1]; ++j) {
+					ijk[1] = lo[1] + j;
+					for (int k = 0; k < mBrickDim[2]; ++k, ++n) {
+						ijk[2] = lo[2] + k;
+						const openvdb::Vec3f& v = acc.getValue(ijk);
+						b0[n] = v[0];
+						b1[n] = v[1];
+						b2[n] = v[2];
+					}
+				}
+			}
+		}
+
+		/// filter the gathered brick, the result is stored in leaf offset order in s.result
+		void convolve(ConvolveScratch& s) const
+		{
+			if (mBackend == CONVOLVE_SEPARABLE) separable(s);
+			else if (mBackend == CONVOLVE_FFT) fft(s);
+			else direct(s);
+		}
+
+	private:
+		void direct(ConvolveScratch& s) const
+		{
+			const int by = mBrickDim[1], bz = mBrickDim[2];
+			const std::vector<DenseKernel::Tap>& taps = mKernel.taps();
+			for (int c = 0; c < 3; ++c) {
+				float* res = s.result[c];
+				std::fill(res, res + LeafT::SIZE, 0.0f);
+				const float* brick = &s.brick[c][0];
+				for (size_t t = 0; t < taps.size(); ++t) {
+					const DenseKernel::Tap& tap = taps[t];
+					for (int i = 0; i < LEAF_DIM; ++i) {
+						for (int j = 0; j < LEAF_DIM; ++j) {
+							const float* src = brick + (size_t(i + tap.i) * by + (j + tap.j)) * bz + tap.k;
+							float* dst = res + (i * LEAF_DIM + j) * LEAF_DIM;
+							for (int k = 0; k < LEAF_DIM; ++k) dst[k] += tap.weight * src[k];
+						}
+					}
+				}
+			}
+		}
+
+		void separable(ConvolveScratch& s) const
+		{
+			const int bx = mBrickDim[0], by = mBrickDim[1], bz = mBrickDim[2];
+			const std::vector<float>& fx = mKernel.factor(0);
+			const std::vector<float>& fy = mKernel.factor(1);
+			const std::vector<float>& fz = mKernel.factor(2);
+			for (int c = 0; c < 3; ++c) {
+				const float* brick = &s.brick[c][0];
+				// z pass: bx * by * 8
+				std::vector<float>& zPass = s.pass[0];
+				zPass.assign(size_t(bx) * by * LEAF_DIM, 0.0f);
+				for (int i = 0; i < bx; ++i)
+					for (int j = 0; j < by; ++j) {
+						const float* src = brick + (size_t(i) * by + j) * bz;
+						float* dst = &zPass[(size_t(i) * by + j) * LEAF_DIM];
+						for (size_t u = 0; u < fz.size(); ++u) {
+							if (fz[u] == 0.0f) continue;
+							for (int k = 0; k < LEAF_DIM; ++k) dst[k] += fz[u] * src[k + u];
+						}
+					}
+				// y pass: bx * 8 * 8
+				std::vector<float>& yPass = s.pass[1];
+				yPass.assign(size_t(bx) * LEAF_DIM * LEAF_DIM, 0.0f);
+				for (int i = 0; i < bx; ++i)
+					for (int j = 0; j < LEAF_DIM; ++j) {
+						float* dst = &yPass[(size_t(i) * LEAF_DIM + j) * LEAF_DIM];
+						for (size_t u = 0; u < fy.size(); ++u) {
+							if (fy[u] == 0.0f) continue;
+							const float* src = &zPass[(size_t(i) * by + j + u) * LEAF_DIM];
+							for (int k = 0; k < LEAF_DIM; ++k) dst[k] += fy[u] * src[k];
+						}
+					}
+				// x pass: 8 * 8 * 8
+				float* res = s.result[c];
+				std::fill(res, res + LeafT::SIZE, 0.0f);
+				for (int i = 0; i < LEAF_DIM; ++i) {
+					float* dst = res + i * LEAF_DIM * LEAF_DIM;
+					for (size_t u = 0; u < fx.size(); ++u) {
+						if (fx[u] == 0.0f) continue;
+						const float* src = &yPass[(i + u) * LEAF_DIM * LEAF_DIM];
+						for (int n = 0; n < LEAF_DIM * LEAF_DIM; ++n) dst[n] += fx[u] * src[n];
+					}
+				}
+			}
+		}
+
+		size_t fftIndex(int x, int y, int z) const { return (size_t(x) * mFftDim[1] + y) * mFftDim[2] + z; }
+
+		void fft3d(std::complex<float>* data, bool inverse) const
+		{
+			const int nx = mFftDim[0], ny = mFftDim[1], nz = mFftDim[2];
+			for (int x = 0; x < nx; ++x)
+				for (int y = 0; y < ny; ++y)
+					internal::fft1d(data + fftIndex(x, y, 0), nz, 1, &mTwiddle[2][0], inverse);
+			for (int x = 0; x < nx; ++x)
+				for (int z = 0; z < nz; ++z)
+					internal::fft1d(data + fftIndex(x, 0, z), ny, nz, &mTwiddle[1][0], inverse);
+			for (int y = 0; y < ny; ++y)
+				for (int z = 0; z < nz; ++z)
+					internal::fft1d(data + fftIndex(0, y, z), nx, ny * nz, &mTwiddle[0][0], inverse);
+		}
+
+		// spectrum of the reversed kernel, so that the cyclic convolution becomes our correlation
+		void initSpectrum()
+		{
+			for (int a = 0; a < 3; ++a) {
+				mFftDim[a] = internal::nextPow2(mBrickDim[a]);
+				const int n = mFftDim[a];
+				mTwiddle[a].resize(std::max(1, n / 2));
+				for (int k = 0; k < n / 2; ++k) {
+					const double phi = -2.0 * openvdb::math::pi<double>() * k / n;
+					mTwiddle[a][k] = std::complex<float>(float(std::cos(phi)), float(std::sin(phi)));
+				}
+			}
+			mSpectrum.assign(size_t(mFftDim[0]) * mFftDim[1] * mFftDim[2], std::complex<float>(0.0f));
+			const std::vector<DenseKernel::Tap>& taps = mKernel.taps();
+			for (size_t t = 0; t < taps.size(); ++t) {
+				const int x = (mFftDim[0] - taps[t].i) % mFftDim[0];
+				const int y = (mFftDim[1] - taps[t].j) % mFftDim[1];
+				const int z = (mFftDim[2] - taps[t].k) % mFftDim[2];
+				mSpectrum[fftIndex(x, y, z)] = taps[t].weight;
+			}
+			fft3d(&mSpectrum[0], false);
+		}
+
+		void fft(ConvolveScratch& s) const
+		{
+			const int by = mBrickDim[1], bz = mBrickDim[2];
+			const size_t count = mSpectrum.size();
+			// two real channels are packed into one complex transform
+			s.spectrum[0].assign(count, std::complex<float>(0.0f));
+			s.spectrum[1].assign(count, std::complex<float>(0.0f));
+			std::complex<float>* s0 = &s.spectrum[0][0];
+			std::complex<float>* s1 = &s.spectrum[1][0];
+			for (int i = 0; i < mBrickDim[0]; ++i)
+				for (int j = 0; j < by; ++j)
+					for (int k = 0; k < bz; ++k) {
+						const size_t b = (size_t(i) * by + j) * bz + k;
+						const size_t f = fftIndex(i, j, k);
+						s0[f] = std::complex<float>(s.brick[0][b], s.brick[1][b]);
+						s1[f] = std::complex<float>(s.brick[2][b], 0.0f);
+					}
+			fft3d(s0, false);
+			fft3d(s1, false);
+			for (size_t n = 0; n < count; ++n) {
+				s0[n] *= mSpectrum[n];
+				s1[n] *= mSpectrum[n];
+			}
+			fft3d(s0, true);
+			fft3d(s1, true);
+			const float scale = 1.0f / float(count);
+			for (int i = 0; i < LEAF_DIM; ++i)
+				for (int j = 0; j < LEAF_DIM; ++j)
+					for (int k = 0; k < LEAF_DIM; ++k) {
+						const int n = (i * LEAF_DIM + j) * LEAF_DIM + k;
+						const size_t f = fftIndex(i, j, k);
+						s.result[0][n] = s0[f].real() * scale;
+						s.result[1][n] = s0[f].imag() * scale;
+						s.result[2][n] = s1[f].real() * scale;
+					}
+		}
+
+		const DenseKernel& mKernel;
+		ConvolveBackend mBackend;
+		int mBrickDim[3];
+		int mFftDim[3];
+		std::vector<std::complex<float> > mTwiddle[3];
+		std::vector<std::complex<float> > mSpectrum;
+	};
+
+	typedef openvdb::tree::LeafManager<openvdb::Vec3STree> ConvolveLeafManager;
+
+	/// Writes the brick convolution of each leaf of a range into auxiliary buffer 1. The tree
+	/// itself is the source snapshot, it is read through an accessor owned by the task.
+	struct BrickConvolveOp {
+		const BrickConvolver* convolver;
+		const ConvolveLeafManager* leafManager;
+
+		BrickConvolveOp(const BrickConvolver& c, const ConvolveLeafManager& lm) :
+			convolver(&c), leafManager(&lm) {}
+
+		void operator()(const ConvolveLeafManager::LeafRange& range) const
+		{
+			openvdb::tree::ValueAccessor<const openvdb::Vec3STree> source(leafManager->tree());
+			ConvolveScratch scratch;
+			for (ConvolveLeafManager::LeafRange::Iterator leafIter = range.begin(); leafIter; ++leafIter) {
+				convolver->gather(source, leafIter->origin(), scratch);
+				convolver->convolve(scratch);
+				BrickConvolver::LeafT::Buffer& result = leafManager->getBuffer(leafIter.pos(), 1);
+				for (BrickConvolver::LeafT::ValueOnCIter iter = leafIter->cbeginValueOn(); iter; ++iter) {
+					const openvdb::Index n = iter.pos();
+					result.setValue(n, openvdb::Vec3f(scratch.result[0][n], scratch.result[1][n], scratch.result[2][n]));
+				}
+			}
+		}
+	};
+
+	/// Per voxel walk over the kernel taps, summed in the order of the active values of the
+	/// kernel grid like the original foreach path. Writes into auxiliary buffer 1 as above.
+	struct ReferenceConvolveOp {
+		const std::vector<openvdb::Coord>* offsets;
+		const std::vector<float>* weights;
+		const ConvolveLeafManager* leafManager;
+
+		ReferenceConvolveOp(const std::vector<openvdb::Coord>& o, const std::vector<float>& w, const ConvolveLeafManager& lm) :
+			offsets(&o), weights(&w), leafManager(&lm) {}
+
+		void operator()(const ConvolveLeafManager::LeafRange& range) const
+		{
+			openvdb::tree::ValueAccessor<const openvdb::Vec3STree> source(leafManager->tree());
+			const size_t taps = offsets->size();
+			for (ConvolveLeafManager::LeafRange::Iterator leafIter = range.begin(); leafIter; ++leafIter) {
+				BrickConvolver::LeafT::Buffer& result = leafManager->getBuffer(leafIter.pos(), 1);
+				for (BrickConvolver::LeafT::ValueOnCIter iter = leafIter->cbeginValueOn(); iter; ++iter) {
+					const openvdb::Coord ijk = iter.getCoord();
+					openvdb::Vec3f temp(0.0f, 0.0f, 0.0f);
+					for (size_t t = 0; t < taps; ++t) temp += source.getValue(ijk + (*offsets)[t]) * (*weights)[t];
+					result.setValue(iter.pos(), temp);
+				}
+			}
+		}
+	};
+
+	/// Convolves the active voxels of grid in parallel leaf tiles. The results go into one
+	/// auxiliary buffer per leaf and are swapped in at the end, so the extra memory is a single
+	/// copy of the leaves instead of a deep copy of the grid.
+	inline void convolveBricks(openvdb::Vec3SGrid& grid, const BrickConvolver& convolver)
+	{
+		// the leaf tiles skip active tiles, split them up first
+		grid.tree().voxelizeActiveTiles();
+		ConvolveLeafManager leafManager(grid.tree(), 1);
+		tbb::parallel_for(leafManager.leafRange(), BrickConvolveOp(convolver, leafManager));
+		leafManager.swapLeafBuffer(1);
+	}
+
+	/// Tiled version of the per tap reference path, see convolveBricks.
+	inline void convolveReference(openvdb::Vec3SGrid& grid, const openvdb::FloatGrid& kernel)
+	{
+		std::vector<openvdb::Coord> offsets;
+		std::vector<float> weights;
+		kernelTaps(kernel, offsets, weights);
+		grid.tree().voxelizeActiveTiles();
+		ConvolveLeafManager leafManager(grid.tree(), 1);
+		tbb::parallel_for(leafManager.leafRange(), ReferenceConvolveOp(offsets, weights, leafManager));
+		leafManager.swapLeafBuffer(1);
+	}
+}
@@ -0,0 +1,397 @@
+#pragma once
+#include <openvdb/openvdb.h>
+#include <openvdb/tools/GridOperators.h>
+
+#include <openvdb/tools/Interpolation.h>
+#include <openvdb/tree/LeafManager.h>
+#include <tbb/parallel_for.h>
+#include <cmath>
+using VelocityAccessor = typename openvdb::Vec3SGrid::ConstAccessor;
+using GradientAccessor = typename openvdb::Vec3SGrid::ConstAccessor;
+using Gradient_fastSampler = openvdb::tools::GridSampler<openvdb::Vec3SGrid::ConstAccessor, openvdb::tools::QuadraticSampler>;
+
+/// Stages the vectors of the leaf at leafOrigin plus a one voxel halo in three float arrays of
+/// (DIM + 2)^3 entries, x major like the leaf buffer. The interior is copied from the leaf, the halo
+/// is fetched through the accessor.
+inline void gatherVectorHalo(VelocityAccessor& accessor, const openvdb::Coord& leafOrigin,
+	float* vx, float* vy, float* vz)
+{
+	typedef openvdb::Vec3STree::LeafNodeType VectorLeafT;
+	const int HALO_DIM = VectorLeafT::DIM + 2;
+	const VectorLeafT* leaf = accessor.probeConstLeaf(leafOrigin);
+	const openvdb::Coord origin = leafOrigin - openvdb::Coord(1);
+	openvdb::Coord ijk;
+	int n = 0;
+	for (int i = 0; i < HALO_DIM; ++i) {
+		ijk[0] = origin[0] + i;
+		const bool haloI = (i == 0 || i == HALO_DIM - 1);
+		for (int j = 0; j < HALO_DIM; ++j) {
+			ijk[1] = origin[1] + j;
+			const bool haloJ = haloI || (j == 0 || j == HALO_DIM - 1);
+			for (int k = 0; k < HALO_DIM; ++k, ++n) {
+				ijk[2] = origin[2] + k;
+				const bool halo = !leaf || haloJ || (k == 0 || k == HALO_DIM - 1);
+				const openvdb::Vec3f& v = halo ? accessor.getValue(ijk)
+					: leaf->getValue(VectorLeafT::coordToOffset(ijk));
+				vx[n] = v.x();
+				vy[n] = v.y();
+				vz[n] = v.z();
+			}
+		}
+	}
+}
+
+/// Tangential divergence of a velocity field on a narrow band, the divergence of the velocity
+/// projected onto the tangent plane of the surface at every voxel. Every output leaf stages the
+/// velocity of the leaf plus a one voxel halo and the normals of the leaf in contiguous arrays.
+/// Since the projection is linear, the six projected differences become three projected central
+/// differences, computed row by row on plain float arrays.
+class TangentialDivergenceOp {
+public:
+	typedef openvdb::FloatTree::LeafNodeType LeafT;
+	typedef openvdb::Vec3STree::LeafNodeType VectorLeafT;
+	typedef openvdb::tree::LeafManager<openvdb::FloatTree> LeafManagerT;
+
+	static const int DIM = LeafT::DIM;
+	static const int HALO_DIM = DIM + 2;
+	static const int HALO_SIZE = HALO_DIM * HALO_DIM * HALO_DIM;
+
+	TangentialDivergenceOp(const openvdb::Vec3SGrid& velocity, const openvdb::Vec3SGrid& gradient) :
+		mVelocity(&velocity), mGradient(&gradient),
+		mAligned(velocity.transform() == gradient.transform()),
+		mScale(1.0f / (2.0f * float(velocity.transform().voxelSize().x()))) {}
+
+	void operator()(const LeafManagerT::LeafRange& range) const
+	{
+		VelocityAccessor velocityAccessor = mVelocity->getConstAccessor();
+		GradientAccessor gradientAccessor = mGradient->getConstAccessor();
+		Gradient_fastSampler gradientSampler(gradientAccessor, mGradient->transform());
+
+		float vx[HALO_SIZE], vy[HALO_SIZE], vz[HALO_SIZE];
+		float nx[LeafT::SIZE], ny[LeafT::SIZE], nz[LeafT::SIZE];
+		float divergence[DIM];
+		const int sx = HALO_DIM * HALO_DIM, sy = HALO_DIM, sz = 1;
+
+		for (LeafManagerT::LeafRange::Iterator leafIter = range.begin(); leafIter; ++leafIter) {
+			LeafT& leaf = *leafIter;
+			gatherVectorHalo(velocityAccessor, leaf.origin(), vx, vy, vz);
+			gatherNormals(gradientAccessor, gradientSampler, leaf.origin(), nx, ny, nz);
+
+			float* data = leaf.buffer().data();
+			for (int i = 0; i < DIM; ++i) {
+				for (int j = 0; j < DIM; ++j) {
+					const int row = ((i + 1) * HALO_DIM + (j + 1)) * HALO_DIM + 1;
+					const int base = (i << (2 * LeafT::LOG2DIM)) + (j << LeafT::LOG2DIM);
+					for (int k = 0; k < DIM; ++k) {
+						const int c = row + k;
+						const float n0 = nx[base + k], n1 = ny[base + k], n2 = nz[base + k];
+						const float ax = vx[c + sx] - vx[c - sx], ay = vy[c + sx] - vy[c - sx], az = vz[c + sx] - vz[c - sx];
+						const float bx = vx[c + sy] - vx[c - sy], by = vy[c + sy] - vy[c - sy], bz = vz[c + sy] - vz[c - sy];
+						const float cx = vx[c + sz] - vx[c - sz], cy = vy[c + sz] - vy[c - sz], cz = vz[c + sz] - vz[c - sz];
+						const float dudx = ax - (ax * n0 + ay * n1 + az * n2) * n0;
+						const float dvdy = by - (bx * n0 + by * n1 + bz * n2) * n1;
+						const float dwdz = cz - (cx * n0 + cy * n1 + cz * n2) * n2;
+						divergence[k] = (dudx + dvdy + dwdz) * mScale;
+					}
+					for (int k = 0; k < DIM; ++k) {
+						if (leaf.isValueOn(base + k)) data[base + k] = divergence[k];
+					}
+				}
+			}
+		}
+	}
+
+private:
+	// unit normals of the leaf voxels, read straight from the gradient leaf when the grids are aligned
+	void gatherNormals(GradientAccessor& accessor, const Gradient_fastSampler& sampler,
+		const openvdb::Coord& origin, float* nx, float* ny, float* nz) const
+	{
+		const VectorLeafT* leaf = mAligned ? accessor.probeConstLeaf(origin) : NULL;
+		for (openvdb::Index n = 0; n < LeafT::SIZE; ++n) {
+			const openvdb::Coord ijk = origin + VectorLeafT::offsetToLocalCoord(n);
+			openvdb::Vec3f normal;
+			if (leaf) normal = leaf->getValue(n);
+			else if (mAligned) normal = accessor.getValue(ijk);
+			else normal = sampler.wsSample(mVelocity->transform().indexToWorld(ijk));
+			if (!normal.normalize()) normal.setZero();
+			nx[n] = normal.x();
+			ny[n] = normal.y();
+			nz[n] = normal.z();
+		}
+	}
+
+	const openvdb::Vec3SGrid* mVelocity;
+	const openvdb::Vec3SGrid* mGradient;
+	bool mAligned;
+	float mScale;
+};
+
+/// Writes the tangential divergence of velocity into target on the active voxels of velocity.
+/// target is expected to be empty, e.g. created with FloatGrid::create(velocity).
+inline void tangentialDivergence(const openvdb::Vec3SGrid& velocity, const openvdb::Vec3SGrid& gradient,
+	openvdb::FloatGrid& target)
+{
+	target.tree().topologyUnion(velocity.tree());
+	target.tree().voxelizeActiveTiles();
+
+	TangentialDivergenceOp::LeafManagerT leafManager(target.tree());
+	tbb::parallel_for(leafManager.leafRange(), TangentialDivergenceOp(velocity, gradient));
+}
+
+/// Jacobian coupling of SOP_VdbApplyCurl, the leaf blocked version of applyJacobiMatrix: every
+/// velocity is replaced by J v, with J the central differences (not divided by the voxel size) of
+/// the external velocity. Every leaf stages the external velocity with a one voxel halo and its
+/// own velocities in float arrays, the products are then computed row by row.
+class JacobianCouplingOp {
+public:
+	typedef openvdb::Vec3STree::LeafNodeType LeafT;
+	typedef openvdb::tree::LeafManager<openvdb::Vec3STree> LeafManagerT;
+
+	static const int DIM = LeafT::DIM;
+	static const int HALO_DIM = DIM + 2;
+	static const int HALO_SIZE = HALO_DIM * HALO_DIM * HALO_DIM;
+
+	/// @param exvel  external velocity in the index space of the velocity
+	explicit JacobianCouplingOp(const openvdb::Vec3SGrid& exvel) : mExvel(&exvel) {}
+
+	void operator()(const LeafManagerT::LeafRange& range) const
+	{
+		VelocityAccessor exvelAccessor = mExvel->getConstAccessor();
+
+		float ex[HALO_SIZE], ey[HALO_SIZE], ez[HALO_SIZE];
+		float ux[DIM], uy[DIM], uz[DIM];
+		float rx[DIM], ry[DIM], rz[DIM];
+		const int sx = HALO_DIM * HALO_DIM, sy = HALO_DIM, sz = 1;
+
+		for (LeafManagerT::LeafRange::Iterator leafIter = range.begin(); leafIter; ++leafIter) {
+			LeafT& leaf = *leafIter;
+			gatherVectorHalo(exvelAccessor, leaf.origin(), ex, ey, ez);
+
+			openvdb::Vec3f* data = leaf.buffer().data();
+			for (int i = 0; i < DIM; ++i) {
+				for (int j = 0; j < DIM; ++j) {
+					const int row = ((i + 1) * HALO_DIM + (j + 1)) * HALO_DIM + 1;
+					const int base = (i << (2 * LeafT::LOG2DIM)) + (j << LeafT::LOG2DIM);
+					for (int k = 0; k < DIM; ++k) {
+						ux[k] = data[base + k].x();
+						uy[k] = data[base + k].y();
+						uz[k] = data[base + k].z();
+					}
+					for (int k = 0; k < DIM; ++k) {
+						const int c = row + k;
+						const float dudx = ex[c + sx] - ex[c - sx], dvdx = ey[c + sx] - ey[c - sx], dwdx = ez[c + sx] - ez[c - sx];
+						const float dudy = ex[c + sy] - ex[c - sy], dvdy = ey[c + sy] - ey[c - sy], dwdy = ez[c + sy] - ez[c - sy];
+						const float dudz = ex[c + sz] - ex[c - sz], dvdz = ey[c + sz] - ey[c - sz], dwdz = ez[c + sz] - ez[c - sz];
+						rx[k] = dudx * ux[k] + dudy * uy[k] + dudz * uz[k];
+						ry[k] = dvdx * ux[k] + dvdy * uy[k] + dvdz * uz[k];
+						rz[k] = dwdx * ux[k] + dwdy * uy[k] + dwdz * uz[k];
+					}
+					for (int k = 0; k < DIM; ++k) {
+						if (leaf.isValueOn(base + k)) data[base + k] = openvdb::Vec3f(rx[k], ry[k], rz[k]);
+					}
+				}
+			}
+		}
+	}
+
+private:
+	const openvdb::Vec3SGrid* mExvel;
+};
+
+/// Replaces every active velocity by the product of the external velocity's Jacobian with it.
+inline void applyJacobianCoupling(openvdb::Vec3SGrid& velocity, const openvdb::Vec3SGrid& exvel)
+{
+	velocity.tree().voxelizeActiveTiles();
+
+	JacobianCouplingOp::LeafManagerT leafManager(velocity.tree());
+	tbb::parallel_for(leafManager.leafRange(), JacobianCouplingOp(exvel));
+}
+
+// sampler of the second vector field, the order matches the "interpolation" menus of VDB Project
+// Vector and VDB CrossProduct
+enum FieldSamplerOrder {
+	SAMPLER_POINT = 0,
+	SAMPLER_BOX,
+	SAMPLER_QUADRATIC
+};
+
+/// Reads a vector field at the voxels of another grid, sampled with SamplerT in world space
+template<typename SamplerT, bool Aligned>
+class VectorFieldReader {
+public:
+	VectorFieldReader(const openvdb::Vec3SGrid& field, const openvdb::math::Transform& target) :
+		mAccessor(field.getConstAccessor()), mSampler(mAccessor, field.transform()), mTarget(&target) {}
+
+	void setLeaf(const openvdb::Coord&) {}
+
+	openvdb::Vec3f operator()(const openvdb::Coord& ijk, openvdb::Index) const { return mSampler.wsSample(mTarget->indexToWorld(ijk)); }
+
+private:
+	VelocityAccessor mAccessor;
+	openvdb::tools::GridSampler<VelocityAccessor, SamplerT> mSampler;
+	const openvdb::math::Transform* mTarget;
+};
+
+/// Both grids share their transform, so every voxel lies on a voxel of the field, where all three
+/// samplers return the voxel itself. The field is read straight from its leaf buffer.
+template<typename SamplerT>
+class VectorFieldReader<SamplerT, true> {
+public:
+	VectorFieldReader(const openvdb::Vec3SGrid& field, const openvdb::math::Transform&) :
+		mAccessor(field.getConstAccessor()), mLeaf(NULL) {}
+
+	void setLeaf(const openvdb::Coord& origin) { mLeaf = mAccessor.probeConstLeaf(origin); }
+
+	openvdb::Vec3f operator()(const openvdb::Coord& ijk, openvdb::Index offset) const
+	{
+		return mLeaf ? mLeaf->getValue(offset) : mAccessor.getValue(ijk);
+	}
+
+private:
+	VelocityAccessor mAccessor;
+	const openvdb::Vec3STree::LeafNodeType* mLeaf;
+};
+
+/// Leaf parallel ProjectVectorToSurface, the gradient is read through VectorFieldReader
+template<typename SamplerT, bool Aligned>
+class ProjectVectorOp {
+public:
+	typedef openvdb::tree::LeafManager<openvdb::Vec3STree> LeafManagerT;
+
+	ProjectVectorOp(const openvdb::Vec3SGrid& gradient, const openvdb::math::Transform& transform, bool keepLength) :
+		mGradient(&gradient), mTransform(&transform), mKeepLength(keepLength) {}
+
+	void operator()(const LeafManagerT::LeafRange& range) const
+	{
+		VectorFieldReader<SamplerT, Aligned> gradient(*mGradient, *mTransform);
+		for (LeafManagerT::LeafRange::Iterator leafIter = range.begin(); leafIter; ++leafIter) {
+			gradient.setLeaf(leafIter->origin());
+			for (openvdb::Vec3STree::LeafNodeType::ValueOnIter it = leafIter->beginValueOn(); it; ++it) {
+				openvdb::Vec3f normal = gradient(it.getCoord(), it.pos());
+				const openvdb::Vec3f oldVelocity = *it;
+				normal.normalize();
+				openvdb::Vec3f projected = oldVelocity - oldVelocity.projection(normal);
+				if (mKeepLength) {
+					projected.normalize();
+					projected *= oldVelocity.length();
+				}
+				it.setValue(projected);
+			}
+		}
+	}
+
+private:
+	const openvdb::Vec3SGrid* mGradient;
+	const openvdb::math::Transform* mTransform;
+	bool mKeepLength;
+};
+
+/// Leaf parallel CrossProduct, b is read through VectorFieldReader
+template<typename SamplerT, bool Aligned>
+class CrossProductOp {
+public:
+	typedef openvdb::tree::LeafManager<openvdb::Vec3STree> LeafManagerT;
+
+	CrossProductOp(const openvdb::Vec3SGrid& b, const openvdb::math::Transform& transform) : mB(&b), mTransform(&transform) {}
+
+	void operator()(const LeafManagerT::LeafRange& range) const
+	{
+		VectorFieldReader<SamplerT, Aligned> b(*mB, *mTransform);
+		for (LeafManagerT::LeafRange::Iterator leafIter = range.begin(); leafIter; ++leafIter) {
+			b.setLeaf(leafIter->origin());
+			for (openvdb::Vec3STree::LeafNodeType::ValueOnIter it = leafIter->beginValueOn(); it; ++it) {
+				it.setValue(it->cross(b(it.getCoord(), it.pos())));
+			}
+		}
+	}
+
+private:
+	const openvdb::Vec3SGrid* mB;
+	const openvdb::math::Transform* mTransform;
+};
+
+/// Runs OpT<SamplerT, Aligned> over the leaves of grid. The sampler and whether field shares the
+/// transform of grid are decided once here, the ops are compiled for every combination.
+template<template<typename, bool> class OpT, typename... ArgsT>
+inline void forEachLeafWithField(openvdb::Vec3SGrid& grid, const openvdb::Vec3SGrid& field, int order, const ArgsT&... args)
+{
+	typedef openvdb::tree::LeafManager<openvdb::Vec3STree> LeafManagerT;
+	// the grid is processed leaf by leaf, active tiles would be skipped
+	grid.tree().voxelizeActiveTiles();
+	LeafManagerT leafManager(grid.tree());
+	const openvdb::math::Transform& transform = grid.transform();
+
+	if (field.transform() == transform) {
+		// the sampler makes no difference on aligned grids
+		tbb::parallel_for(leafManager.leafRange(), OpT<openvdb::tools::PointSampler, true>(field, transform, args...));
+		return;
+	}
+	switch (order) {
+	case SAMPLER_POINT:
+		tbb::parallel_for(leafManager.leafRange(), OpT<openvdb::tools::PointSampler, false>(field, transform, args...));
+		break;
+	case SAMPLER_BOX:
+		tbb::parallel_for(leafManager.leafRange(), OpT<openvdb::tools::BoxSampler, false>(field, transform, args...));
+		break;
+	default:
+		tbb::parallel_for(leafManager.leafRange(), OpT<openvdb::tools::QuadraticSampler, false>(field, transform, args...));
+		break;
+	}
+}
+
+/// Offset between two index spaces that only differ by a whole number of voxels, source voxel
+/// ijk - offset lies on target voxel ijk. Returns false for anything else, including scaling,
+/// rotation, fractional shifts and non linear maps.
+inline bool voxelAligned(const openvdb::math::Transform& source, const openvdb::math::Transform& target, openvdb::Coord& offset)
+{
+	if (!source.isLinear() || !target.isLinear()) return false;
+	const openvdb::Mat4R xform =
+		source.baseMap()->getAffineMap()->getMat4() *
+		target.baseMap()->getAffineMap()->getMat4().inverse();
+	if (!xform.getMat3().eq(openvdb::Mat3R::identity(), 1.0e-6)) return false;
+	const openvdb::Vec3R translation = xform.getTranslation();
+	for (int axis = 0; axis < 3; ++axis) {
+		const double rounded = std::floor(translation[axis] + 0.5);
+		if (std::abs(translation[axis] - rounded) > 1.0e-6) return false;
+		offset[axis] = int(rounded);
+	}
+	return true;
+}
+
+/// Brings source into the index space of target, on the active voxels of band only. A source that
+/// already has the target transform is returned as it is, without a copy. Voxel aligned sources are
+/// copied voxel by voxel, everything else is sampled trilinearly in world space. Unlike
+/// GridTransformer, nothing outside of the band is ever resampled.
+template<typename GridT, typename BandTreeT>
+inline typename GridT::ConstPtr
+resampleOnBand(const typename GridT::ConstPtr& source, const openvdb::math::Transform& target, const BandTreeT& band)
+{
+	typedef typename GridT::TreeType TreeT;
+	typedef openvdb::tree::LeafManager<TreeT> LeafManagerT;
+	typedef openvdb::tools::GridSampler<typename GridT::ConstAccessor, openvdb::tools::BoxSampler> SamplerT;
+
+	if (source->transform() == target) return source;
+
+	typename GridT::Ptr result = GridT::create(source->background());
+	result->setTransform(target.copy());
+	result->tree().topologyUnion(band);
+	result->tree().voxelizeActiveTiles();
+
+	openvdb::Coord offset;
+	const bool aligned = voxelAligned(source->transform(), target, offset);
+	const GridT& sourceGrid = *source;
+
+	LeafManagerT leafManager(result->tree());
+	tbb::parallel_for(leafManager.leafRange(), [&](const typename LeafManagerT::LeafRange& range) {
+		typename GridT::ConstAccessor accessor = sourceGrid.getConstAccessor();
+		SamplerT sampler(accessor, sourceGrid.transform());
+		for (typename LeafManagerT::LeafRange::Iterator leafIter = range.begin(); leafIter; ++leafIter) {
+			typename TreeT::LeafNodeType& leaf = *leafIter;
+			for (typename TreeT::LeafNodeType::ValueOnIter it = leaf.beginValueOn(); it; ++it) {
+				const openvdb::Coord ijk = it.getCoord();
+				it.setValue(aligned ? accessor.getValue(ijk - offset) : sampler.wsSample(target.indexToWorld(ijk)));
+			}
+		}
+	});
+	return result;
+}
@@ -0,0 +1,212 @@
+#pragma once
+#include <openvdb/openvdb.h>
+#include <openvdb/math/ConjGradient.h>
+#include <openvdb/tools/PoissonSolver.h>
+#include <openvdb/tree/LeafManager.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <memory>
+#include <vector>
+
+namespace VdbCappucino {
+
+	/// Geometric multigrid V-cycle for the pressure matrix of a narrow band, usable as a
+	/// preconditioner with math::pcg::solve(). Every coarser level aggregates 2x2x2 voxels of the
+	/// index tree above it (coordinates shifted right by one) and gets the Galerkin operator of
+	/// piecewise constant interpolation, which keeps the 7 point structure of the stencil.
+	/// Smoothing is weighted Jacobi with the same number of sweeps before and after the coarse
+	/// correction, so the V-cycle stays symmetric as PCG requires.
+	class MultigridPreconditioner : public openvdb::math::pcg::Preconditioner<openvdb::tools::poisson::LaplacianMatrix::ValueType> {
+	public:
+		typedef openvdb::tools::poisson::LaplacianMatrix MatrixT;
+		typedef MatrixT::ValueType ValueType;
+		typedef openvdb::math::pcg::Vector<ValueType> VectorT;
+		typedef openvdb::math::pcg::SizeType SizeType;
+		typedef openvdb::FloatTree::ValueConverter<openvdb::tools::poisson::VIndex>::Type VIndexTree;
+		typedef openvdb::math::pcg::Preconditioner<ValueType> BaseT;
+
+		static const int MAX_LEVELS = 12;
+		static const SizeType COARSEST_SIZE = 512;
+		static const int COARSEST_SWEEPS = 20;
+
+		MultigridPreconditioner(const MatrixT& matrix, const VIndexTree::ConstPtr& idxTree, int smoothingSteps = 2) :
+			BaseT(matrix), mSmoothingSteps(smoothingSteps < 1 ? 1 : smoothingSteps), mWeight(ValueType(2.0 / 3.0)), mValid(false)
+		{
+			if (!idxTree || idxTree->activeVoxelCount() != matrix.numRows()) return;
+
+			mLevels.push_back(std::unique_ptr<Level>(new Level(matrix, idxTree)));
+			while (int(mLevels.size()) < MAX_LEVELS) {
+				Level& fine = *mLevels.back();
+				if (fine.size() <= COARSEST_SIZE) break;
+				std::unique_ptr<Level> coarse = coarsen(fine);
+				if (!coarse) break;
+				mLevels.push_back(std::move(coarse));
+			}
+			mValid = true;
+		}
+
+		virtual bool isValid() const { return mValid; }
+
+		virtual void apply(const VectorT& r, VectorT& z) { vcycle(0, r, z); }
+
+		size_t levelCount() const { return mLevels.size(); }
+
+	private:
+		struct Level {
+			MatrixT::Ptr ownedMatrix;
+			const MatrixT* matrix;
+			VIndexTree::ConstPtr idxTree;
+			VectorT invDiagonal;
+			VectorT r, z, scratch;
+			// fine dof -> coarse dof and the fine dofs of every coarse dof, empty on the coarsest level
+			std::vector<SizeType> aggregate;
+			std::vector<SizeType> childOffsets;
+			std::vector<SizeType> children;
+
+			Level(const MatrixT& m, const VIndexTree::ConstPtr& idx) : matrix(&m), idxTree(idx) { init(); }
+			Level(const MatrixT::Ptr& m, const VIndexTree::ConstPtr& idx) : ownedMatrix(m), matrix(m.get()), idxTree(idx) { init(); }
+
+			SizeType size() const { return matrix->numRows(); }
+
+			void init()
+			{
+				const SizeType n = size();
+				invDiagonal.resize(n);
+				r.resize(n);
+				z.resize(n);
+				scratch.resize(n);
+				tbb::parallel_for(tbb::blocked_range<SizeType>(0, n), [this](const tbb::blocked_range<SizeType>& range) {
+					for (SizeType i = range.begin(); i < range.end(); ++i) {
+						const ValueType diagonal = matrix->getValue(i, i);
+						invDiagonal[i] = diagonal != ValueType(0) ? ValueType(1) / diagonal : ValueType(0);
+					}
+				});
+			}
+		};
+
+		/// Looks up the coarse dof of every fine voxel
+		struct AggregateOp {
+			const VIndexTree* coarseIdx;
+			std::vector<SizeType>* aggregate;
+
+			void operator()(const VIndexTree::LeafNodeType& leaf, size_t) const
+			{
+				openvdb::tree::ValueAccessor<const VIndexTree> coarse(*coarseIdx);
+				for (VIndexTree::LeafNodeType::ValueOnCIter it = leaf.cbeginValueOn(); it; ++it) {
+					(*aggregate)[SizeType(*it)] = SizeType(coarse.getValue(it.getCoord() >> 1));
+				}
+			}
+		};
+
+		/// Sums the fine rows of every aggregate into the coarse row, A_c = P^T A P
+		struct GalerkinOp {
+			const MatrixT* fine;
+			const VIndexTree* fineIdx;
+			const std::vector<SizeType>* aggregate;
+			MatrixT* coarse;
+
+			void operator()(const VIndexTree::LeafNodeType& leaf, size_t) const
+			{
+				openvdb::tree::ValueAccessor<const VIndexTree> fineAccessor(*fineIdx);
+				for (VIndexTree::LeafNodeType::ValueOnCIter it = leaf.cbeginValueOn(); it; ++it) {
+					MatrixT::RowEditor row = coarse->getRowEditor(SizeType(*it));
+					const openvdb::Coord base = it.getCoord() << 1;
+					for (int child = 0; child < 8; ++child) {
+						openvdb::tools::poisson::VIndex fineRow;
+						if (!fineAccessor.probeValue(base.offsetBy(child >> 2, (child >> 1) & 1, child & 1), fineRow)) continue;
+						const MatrixT::ConstRow entries = fine->getConstRow(SizeType(fineRow));
+						for (MatrixT::ConstValueIter entry = entries.cbegin(); entry; ++entry) {
+							const SizeType column = (*aggregate)[entry.column()];
+							row.setValue(column, row.getValue(column) + *entry);
+						}
+					}
+				}
+			}
+		};
+
+		std::unique_ptr<Level> coarsen(Level& fine) const
+		{
+			openvdb::BoolTree coarseMask(false);
+			{
+				openvdb::tree::ValueAccessor<openvdb::BoolTree> mask(coarseMask);
+				for (VIndexTree::ValueOnCIter it = fine.idxTree->cbeginValueOn(); it; ++it) {
+					mask.setValueOn(it.getCoord() >> 1, true);
+				}
+			}
+			VIndexTree::ConstPtr coarseIdx = openvdb::tools::poisson::createIndexTree(coarseMask);
+			const SizeType coarseSize = SizeType(coarseIdx->activeVoxelCount());
+			// a level that hardly shrinks costs more than it helps
+			if (coarseSize == 0 || 10 * openvdb::Index64(coarseSize) > 9 * openvdb::Index64(fine.size())) return std::unique_ptr<Level>();
+
+			fine.aggregate.resize(fine.size());
+			openvdb::tree::LeafManager<const VIndexTree> fineLeaves(*fine.idxTree);
+			AggregateOp aggregateOp = { coarseIdx.get(), &fine.aggregate };
+			fineLeaves.foreach(aggregateOp);
+
+			fine.childOffsets.assign(coarseSize + 1, 0);
+			for (SizeType i = 0; i < fine.size(); ++i) ++fine.childOffsets[fine.aggregate[i] + 1];
+			for (SizeType i = 0; i < coarseSize; ++i) fine.childOffsets[i + 1] += fine.childOffsets[i];
+			fine.children.resize(fine.size());
+			std::vector<SizeType> fill(fine.childOffsets.begin(), fine.childOffsets.end() - 1);
+			for (SizeType i = 0; i < fine.size(); ++i) fine.children[fill[fine.aggregate[i]]++] = i;
+
+			MatrixT::Ptr coarseMatrix(new MatrixT(coarseSize));
+			openvdb::tree::LeafManager<const VIndexTree> coarseLeaves(*coarseIdx);
+			GalerkinOp galerkinOp = { fine.matrix, fine.idxTree.get(), &fine.aggregate, coarseMatrix.get() };
+			coarseLeaves.foreach(galerkinOp);
+
+			return std::unique_ptr<Level>(new Level(coarseMatrix, coarseIdx));
+		}
+
+		// z += w D^-1 (r - A z)
+		void jacobi(Level& level, const VectorT& r, VectorT& z) const
+		{
+			level.matrix->vectorMultiply(z, level.scratch);
+			const ValueType weight = mWeight;
+			tbb::parallel_for(tbb::blocked_range<SizeType>(0, level.size()), [&](const tbb::blocked_range<SizeType>& range) {
+				for (SizeType i = range.begin(); i < range.end(); ++i) {
+					z[i] += weight * level.invDiagonal[i] * (r[i] - level.scratch[i]);
+				}
+			});
+		}
+
+		void vcycle(size_t levelIdx, const VectorT& r, VectorT& z)
+		{
+			Level& level = *mLevels[levelIdx];
+			z.fill(ValueType(0));
+			if (levelIdx + 1 == mLevels.size()) {
+				for (int sweep = 0; sweep < COARSEST_SWEEPS; ++sweep) jacobi(level, r, z);
+				return;
+			}
+
+			for (int sweep = 0; sweep < mSmoothingSteps; ++sweep) jacobi(level, r, z);
+
+			// restrict the residual, every coarse dof sums up its aggregate
+			Level& coarse = *mLevels[levelIdx + 1];
+			level.matrix->vectorMultiply(z, level.scratch);
+			tbb::parallel_for(tbb::blocked_range<SizeType>(0, coarse.size()), [&](const tbb::blocked_range<SizeType>& range) {
+				for (SizeType c = range.begin(); c < range.end(); ++c) {
+					ValueType sum = 0;
+					for (SizeType n = level.childOffsets[c]; n < level.childOffsets[c + 1]; ++n) {
+						const SizeType i = level.children[n];
+						sum += r[i] - level.scratch[i];
+					}
+					coarse.r[c] = sum;
+				}
+			});
+
+			vcycle(levelIdx + 1, coarse.r, coarse.z);
+
+			tbb::parallel_for(tbb::blocked_range<SizeType>(0, level.size()), [&](const tbb::blocked_range<SizeType>& range) {
+				for (SizeType i = range.begin(); i < range.end(); ++i) z[i] += coarse.z[level.aggregate[i]];
+			});
+
+			for (int sweep = 0; sweep < mSmoothingSteps; ++sweep) jacobi(level, r, z);
+		}
+
+		std::vector<std::unique_ptr<Level> > mLevels;
+		int mSmoothingSteps;
+		ValueType mWeight;
+		bool mValid;
+	};
+}
@@ -1,5 +1,7 @@
 #pragma once
 #include <openvdb/tools/PoissonSolver.h>
+#include <algorithm>
+#include <cmath>
 
 
 namespace openvdb {
@@ -10,71 +12,36 @@ namespace poisson {
 	template<
 		typename PreconditionerType,
 		typename TreeType,
+		typename DomainTreeType,
 		typename BoundaryOp,
 		typename SurfaceNormalTreeType,
 		typename Interrupter>
 		inline typename TreeType::Ptr
 		solveWithBoundaryConditionsAndPreconditioner2D(
 			const TreeType&,
+			const DomainTreeType&,
 			const BoundaryOp&,
 			const SurfaceNormalTreeType&,
 			math::pcg::State&,
 			Interrupter&,
 			bool staggered = false);
 
-	
-	template<
-		typename PreconditionerType,
-		typename TreeType,
-		typename BoundaryOp, typename SurfaceNormalTreeType,
-		typename Interrupter>
-		inline typename TreeType::Ptr
-		solveWithBoundaryConditionsAndPreconditioner2D(
-			const TreeType& inTree,
-			const BoundaryOp& boundaryOp, const SurfaceNormalTreeType& surfaceNormalTree,
-			math::pcg::State& state,
-			Interrupter& interrupter,
-			bool staggered)
+	/// Weight of the face between two neighbouring voxels along axis in the surface %Laplacian: the
+	/// length of the axis projected onto the tangent plane of the mean of their unit normals,
+	/// sqrt(1 - m_axis^2 / |m|^2). Both rows get the same weight, so the matrix stays symmetric.
+	/// A zero normal (outside the gradient band) leaves the other one, none at all gives 1.
+	template<typename VecT>
+	inline float surfaceFaceWeight(const VecT& a, const VecT& b, int axis)
 	{
-		return solveWithBoundaryConditionsAndPreconditioner2D<PreconditionerType>(
-			/*source=*/inTree, /*domain mask=*/inTree, boundaryOp, surfaceNormalTree, state, interrupter, staggered);
-	};
-	
-
-	template<typename BoolTreeType, typename BoundaryOp, typename SurfaceNormalTreeType>
-	inline LaplacianMatrix::Ptr
-		createISLaplacianWithBoundaryConditions2D(
-			const typename BoolTreeType::template ValueConverter<VIndex>::Type& idxTree,
-			const BoolTreeType& interiorMask,
-			const BoundaryOp& boundaryOp,
-			const SurfaceNormalTreeType& surfaceNormalTree,
-			typename math::pcg::Vector<LaplacianMatrix::ValueType>& source,
-			bool staggered)
-	{
-		using VIdxTreeT = typename BoolTreeType::template ValueConverter<VIndex>::Type;
-		using VIdxLeafMgrT = typename tree::LeafManager<const VIdxTreeT>;
-
-		// The number of active voxels is the number of degrees of freedom.
-		const Index64 numDoF = idxTree.activeVoxelCount();
-
-		// Construct the matrix.
-		LaplacianMatrix::Ptr laplacianPtr(
-			new LaplacianMatrix(static_cast<math::pcg::SizeType>(numDoF)));
-		LaplacianMatrix& laplacian = *laplacianPtr;
-
-		// Populate the matrix using a second-order, 7-point CD stencil.
-		VIdxLeafMgrT idxLeafManager(idxTree);
-		if (staggered) {
-			idxLeafManager.foreach(internal::ISStaggeredLaplacianOp<BoolTreeType, BoundaryOp>(
-				laplacian, idxTree, interiorMask, boundaryOp, source));
-		}
-		else {
-			idxLeafManager.foreach(internal::ISLaplacianOp2D<VIdxTreeT, BoundaryOp, SurfaceNormalTreeType>(
-				laplacian, idxTree, boundaryOp, surfaceNormalTree, source));
-		}
-
-		return laplacianPtr;
+		const double lengthA = a.length(), lengthB = b.length();
+		Vec3d mean(0.0);
+		if (lengthA > 0.0) mean += Vec3d(a) / lengthA;
+		if (lengthB > 0.0) mean += Vec3d(b) / lengthB;
+		const double lengthSqr = mean.lengthSqr();
+		if (!(lengthSqr > 0.0)) return 1.0f;
+		return float(std::sqrt(std::max(0.0, 1.0 - mean[axis] * mean[axis] / lengthSqr)));
 	}
+
 	namespace internal {
 		/// Functor for use with LeafManager::foreach() to populate a sparse %Laplacian matrix
 		template<typename VIdxTreeT, typename BoundaryOp, typename SurfaceNormalTreeType>
@@ -112,8 +79,7 @@ namespace poisson {
 
 					const Coord ijk = it.getCoord();
 					const math::pcg::SizeType rowNum = static_cast<math::pcg::SizeType>(it.getValue());
-					SurfaceNormalTreeType::ValueType normal = surfNormalIdx.getValue(ijk);
-					normal.normalize();
+					const typename SurfaceNormalTreeType::ValueType normal = surfNormalIdx.getValue(ijk);
 					LaplacianMatrix::RowEditor row = laplacian->getRowEditor(rowNum);
 
 					ValueT modifiedDiagonal = 0.f;
@@ -121,14 +87,13 @@ namespace poisson {
 					// For each of the neighbors of the voxel at (i,j,k)...
 					for (int dir = 0; dir < kNumOffsets; ++dir) {
 						const Coord neighbor = ijk + ijkOffset[dir];
-						Vec3s offsetDir = Vec3s(ijkOffset[dir].x(), ijkOffset[dir].y(), ijkOffset[dir].z());
-						offsetDir.normalize();
-						const double length_of_projection = normal.length() > 0 ? (offsetDir-offsetDir.projection(normal)).length():1.0f;
+						// the face weight depends on the normals on both sides, so A(i,j) == A(j,i)
+						const double length_of_projection = surfaceFaceWeight(normal, surfNormalIdx.getValue(neighbor), dir >> 1);
 						VIndex column;
 						// For collocated vector grids, the central differencing stencil requires
 						// access to neighbors at a distance of two voxels in each direction
 						// (-x, +x, -y, +y, -z, +z).
-#if OPENVDB_TOOLS_POISSON_LAPLACIAN_STENCIL == 1
+#if OPENVDB_TOOLS_POISSON_LAPLACIAN_STENCIL == 2
 						const bool ijkIsInterior = (vectorIdx.probeValue(neighbor + ijkOffset[dir], column)
 							&& vectorIdx.isValueOn(neighbor));
 #else
@@ -152,6 +117,41 @@ namespace poisson {
 			}
 		};
 	}//namespaces
+
+	template<typename BoolTreeType, typename BoundaryOp, typename SurfaceNormalTreeType>
+	inline LaplacianMatrix::Ptr
+		createISLaplacianWithBoundaryConditions2D(
+			const typename BoolTreeType::template ValueConverter<VIndex>::Type& idxTree,
+			const BoolTreeType& interiorMask,
+			const BoundaryOp& boundaryOp,
+			const SurfaceNormalTreeType& surfaceNormalTree,
+			typename math::pcg::Vector<LaplacianMatrix::ValueType>& source,
+			bool staggered)
+	{
+		using VIdxTreeT = typename BoolTreeType::template ValueConverter<VIndex>::Type;
+		using VIdxLeafMgrT = typename tree::LeafManager<const VIdxTreeT>;
+
+		// The number of active voxels is the number of degrees of freedom.
+		const Index64 numDoF = idxTree.activeVoxelCount();
+
+		// Construct the matrix.
+		LaplacianMatrix::Ptr laplacianPtr(
+			new LaplacianMatrix(static_cast<math::pcg::SizeType>(numDoF)));
+		LaplacianMatrix& laplacian = *laplacianPtr;
+
+		// Populate the matrix using a second-order, 7-point CD stencil.
+		VIdxLeafMgrT idxLeafManager(idxTree);
+		if (staggered) {
+			idxLeafManager.foreach(internal::ISStaggeredLaplacianOp<BoolTreeType, BoundaryOp>(
+				laplacian, idxTree, interiorMask, boundaryOp, source));
+		}
+		else {
+			idxLeafManager.foreach(internal::ISLaplacianOp2D<VIdxTreeT, BoundaryOp, SurfaceNormalTreeType>(
+				laplacian, idxTree, boundaryOp, surfaceNormalTree, source));
+		}
+
+		return laplacianPtr;
+	}
 	template<
 		typename PreconditionerType,
 		typename TreeType,
@@ -208,6 +208,24 @@ namespace poisson {
 		return createTreeFromVector<TreeValueT>(*x, *idxTree, /*background=*/zeroVal<TreeValueT>());
 	}
 
+	template<
+		typename PreconditionerType,
+		typename TreeType,
+		typename BoundaryOp, typename SurfaceNormalTreeType,
+		typename Interrupter>
+		inline typename TreeType::Ptr
+		solveWithBoundaryConditionsAndPreconditioner2D(
+			const TreeType& inTree,
+			const BoundaryOp& boundaryOp, const SurfaceNormalTreeType& surfaceNormalTree,
+			math::pcg::State& state,
+			Interrupter& interrupter,
+			bool staggered = false)
+	{
+		return solveWithBoundaryConditionsAndPreconditioner2D<PreconditionerType>(
+			/*source=*/inTree, /*domain mask=*/inTree, boundaryOp, surfaceNormalTree, state, interrupter, staggered);
+	};
+	
+
 	
 } // namespace poisson
 } // namespace tools
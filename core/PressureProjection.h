@@ -0,0 +1,427 @@
+#pragma once
+#include <openvdb/openvdb.h>
+#include <openvdb/math/ConjGradient.h>
+#include <openvdb/tools/Morphology.h>
+#include <openvdb/tools/PoissonSolver.h>
+#include <openvdb/tree/LeafManager.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <memory>
+#include <vector>
+#include <PoissonSolver2D.h>
+#include <Diverge.h>
+#include <Multigrid.h>
+#include <PressureSolver.h>
+
+namespace VdbCappucino {
+
+	// Laplacian of the pressure solve, the order matches the "laplacian" menu
+	enum LaplacianMode {
+		LAPLACIAN_VOLUME = 0,	// stock 7 point Laplacian
+		LAPLACIAN_SURFACE		// neighbours weighted by the length of their tangential projection
+	};
+
+	// preconditioner of the pressure solve, the order matches the "preconditioner" menu
+	enum PreconditionerMode {
+		PRECONDITIONER_JACOBI = 0,
+		PRECONDITIONER_INCOMPLETE_CHOLESKY,
+		PRECONDITIONER_MULTIGRID
+	};
+
+	/// Settings of the pressure solve, read from the parameters once per cook
+	struct PressureSolveParms {
+		int iterations;
+		int laplacianMode;
+		int preconditionerMode;
+		bool matrixFree;
+		bool mixedPrecision;	// float vectors, only for the matrix free solve
+		int refinementSteps;	// iterative refinement of the mixed precision solve, 0 for none
+
+		PressureSolveParms() : iterations(50), laplacianMode(LAPLACIAN_VOLUME), preconditionerMode(PRECONDITIONER_JACOBI),
+			matrixFree(false), mixedPrecision(false), refinementSteps(2) {}
+	};
+
+	/// Topology of the pressure band, shared by every stage of a cook: the dof numbering of the
+	/// solve vectors, the matrix or stencil assembly, the warm start and the velocity correction.
+	/// It only depends on the active voxels of the divergence, so it outlives a cook for as long as
+	/// the band does not change.
+	struct BandTopology {
+		typedef std::shared_ptr<BandTopology> Ptr;
+		typedef openvdb::FloatTree::ValueConverter<openvdb::tools::poisson::VIndex>::Type VIndexTree;
+
+		VIndexTree::ConstPtr idxTree;
+
+		explicit BandTopology(const openvdb::FloatTree& band) : idxTree(openvdb::tools::poisson::createIndexTree(band)) {}
+
+		bool matches(const openvdb::FloatTree& band) const { return idxTree->hasSameTopology(band); }
+
+		openvdb::math::pcg::SizeType size() const { return openvdb::math::pcg::SizeType(idxTree->activeVoxelCount()); }
+
+		/// voxels with all six face neighbours in the band, built on first use
+		const openvdb::BoolTree& interiorMask()
+		{
+			if (!mInteriorMask) {
+				mInteriorMask.reset(new openvdb::BoolTree(*idxTree, /*background=*/false, openvdb::TopologyCopy()));
+				openvdb::tools::erodeVoxels(*mInteriorMask, /*iterations=*/1, openvdb::tools::NN_FACE);
+			}
+			return *mInteriorMask;
+		}
+
+	private:
+		openvdb::BoolTree::Ptr mInteriorMask;
+	};
+
+	/// Band topology and pressure matrix of the last cook. Assembly only depends on the band
+	/// topology and, for the surface Laplacian, on the normals, so the matrix is reused for as long
+	/// as both stay the same. The Dirichlet boundary only touches the diagonal, the right hand side
+	/// never has to be cached. The preconditioner is built from the matrix alone and is kept along
+	/// with it. The matrix free solve keeps its stencil here instead of the matrix.
+	struct PressureMatrixCache {
+		typedef BandTopology::VIndexTree VIndexTree;
+		typedef openvdb::math::pcg::Preconditioner<openvdb::tools::poisson::LaplacianMatrix::ValueType> PreconditionerT;
+
+		BandTopology::Ptr topology;
+		int mode;
+		bool matrixFree;
+		openvdb::Vec3STree::ConstPtr normals;
+		openvdb::tools::poisson::LaplacianMatrix::Ptr laplacian;	// already scaled by -1
+		int preconditionerMode;
+		PreconditionerT::Ptr preconditioner;	// may refer to laplacian, reset first
+		SurfaceStencil::Ptr stencil;
+		openvdb::Vec3STree::ConstPtr normalSource;	// gradient tree the band normals were resampled from
+		openvdb::math::Transform::ConstPtr normalSourceTransform;
+		openvdb::Vec3STree::ConstPtr resampledNormals;	// on the band and its face neighbours
+
+		PressureMatrixCache() : mode(-1), matrixFree(false), preconditionerMode(-1) {}
+
+		/// the topology of band, reused when it is the one of the last cook
+		BandTopology& bandTopology(const openvdb::FloatTree& band)
+		{
+			if (!topology || !topology->matches(band)) {
+				clearOperator();
+				clearResampledNormals();
+				topology.reset(new BandTopology(band));
+			}
+			return *topology;
+		}
+
+		/// The normals of gradient in the index space of the band, as the operator reads them by
+		/// index coordinate. A gradient on another transform is resampled onto the band and its
+		/// face neighbours, once for as long as the band and the gradient stay the same, so the
+		/// resampled tree works as the key of the cached operator.
+		openvdb::Vec3STree::ConstPtr bandNormals(const openvdb::Vec3SGrid& gradient, const openvdb::math::Transform& transform)
+		{
+			if (gradient.transform() == transform) return gradient.constTreePtr();
+			if (!resampledNormals || normalSource != gradient.constTreePtr() || *normalSourceTransform != gradient.transform()) {
+				openvdb::BoolTree band(*topology->idxTree, /*background=*/false, openvdb::TopologyCopy());
+				openvdb::tools::dilateVoxels(band, /*iterations=*/1, openvdb::tools::NN_FACE);
+				resampledNormals = resampleOnBand<openvdb::Vec3SGrid>(gradient.copy(), transform, band)->constTreePtr();
+				normalSource = gradient.constTreePtr();
+				normalSourceTransform = gradient.constTransformPtr();
+			}
+			return resampledNormals;
+		}
+
+		/// true when the cached operator was built for the current topology with these settings
+		bool matches(int laplacianMode, bool matrixFreeSolve, const openvdb::Vec3STree::ConstPtr& normalTree) const
+		{
+			if (mode != laplacianMode || matrixFree != matrixFreeSolve) return false;
+			return mode != LAPLACIAN_SURFACE || normals == normalTree;
+		}
+
+		void clearOperator()
+		{
+			preconditionerMode = -1;
+			preconditioner.reset();
+			stencil.reset();
+			mode = -1;
+			matrixFree = false;
+			normals.reset();
+			laplacian.reset();
+		}
+
+		void clearResampledNormals()
+		{
+			normalSource.reset();
+			normalSourceTransform.reset();
+			resampledNormals.reset();
+		}
+
+		void clear()
+		{
+			clearOperator();
+			clearResampledNormals();
+			topology.reset();
+		}
+	};
+
+	typedef PressureMatrixCache::VIndexTree VIndexTree;
+	typedef openvdb::tools::poisson::LaplacianMatrix::ValueType PressureValueType;
+	typedef openvdb::math::pcg::Vector<PressureValueType> PressureVector;
+
+	/// Subtracts the tangential pressure gradient from the velocity. The gradient is taken straight
+	/// from the solution vector through the index tree, voxels outside of the index tree have zero
+	/// pressure, as in the tree createTreeFromVector() would build.
+	template<typename TreeType>
+	struct CorrectVelocityOp
+	{
+		typedef typename TreeType::LeafNodeType LeafNodeType;
+		typedef typename TreeType::ValueType    ValueType;
+
+		CorrectVelocityOp(LeafNodeType** velocityNodes, const VIndexTree& idxTree, const PressureVector& pressure,
+			const openvdb::Vec3SGrid& gradient, const openvdb::math::Transform& transform, double dx)
+			: mVelocityNodes(velocityNodes), mIdxTree(&idxTree), mPressure(&pressure), mGradient(&gradient),
+			mTransform(&transform), mVoxelSize(dx)
+		{
+		}
+
+		void operator()(const tbb::blocked_range<size_t>& range) const {
+
+			typedef typename ValueType::value_type ElementType;
+			const ElementType scale = ElementType(mVoxelSize * mVoxelSize);
+			const PressureValueType invTwoDx = PressureValueType(1.0 / (2.0 * mVoxelSize));
+
+			openvdb::tree::ValueAccessor<const VIndexTree> idxAccessor(*mIdxTree);
+			GradientAccessor gradientAccessor = mGradient->getConstAccessor();
+			Gradient_fastSampler gradientSampler(gradientAccessor, mGradient->transform());
+
+			for (size_t n = range.begin(), N = range.end(); n < N; ++n) {
+
+				LeafNodeType& velocityNode = *mVelocityNodes[n];
+				ValueType* velocityData = velocityNode.buffer().data();
+
+				for (typename LeafNodeType::ValueOnIter it = velocityNode.beginValueOn(); it; ++it) {
+					const openvdb::math::Coord coord = it.getCoord();
+					if (!idxAccessor.isValueOn(coord)) continue;
+
+					openvdb::Vec3f gradientOfPressure(
+						float((pressure(idxAccessor, coord.offsetBy(1, 0, 0)) - pressure(idxAccessor, coord.offsetBy(-1, 0, 0))) * invTwoDx),
+						float((pressure(idxAccessor, coord.offsetBy(0, 1, 0)) - pressure(idxAccessor, coord.offsetBy(0, -1, 0))) * invTwoDx),
+						float((pressure(idxAccessor, coord.offsetBy(0, 0, 1)) - pressure(idxAccessor, coord.offsetBy(0, 0, -1))) * invTwoDx));
+
+					openvdb::Vec3f normal = gradientSampler.wsSample(mTransform->indexToWorld(coord));
+					normal.normalize();
+					gradientOfPressure -= gradientOfPressure.projection(normal);
+
+					velocityData[it.pos()] -= scale * gradientOfPressure;
+				}
+			}
+		}
+
+		inline PressureValueType pressure(openvdb::tree::ValueAccessor<const VIndexTree>& idxAccessor, const openvdb::Coord& ijk) const
+		{
+			openvdb::tools::poisson::VIndex idx;
+			return idxAccessor.probeValue(ijk, idx) ? (*mPressure)[idx] : PressureValueType(0);
+		}
+
+		LeafNodeType       * const * const mVelocityNodes;
+		const VIndexTree* mIdxTree;
+		const PressureVector* mPressure;
+		const openvdb::Vec3SGrid* mGradient;
+		const openvdb::math::Transform* mTransform;
+		double                       const mVoxelSize;
+	}; // class CorrectVelocityOp
+
+
+	/// Fills the initial guess of the solve with the pressure of the previous substep. Grids with
+	/// the transform of the band are read voxel by voxel, anything else is resampled trilinearly.
+	struct WarmStartOp
+	{
+		typedef openvdb::tools::GridSampler<openvdb::FloatGrid::ConstAccessor, openvdb::tools::BoxSampler> PressureSampler;
+
+		const openvdb::FloatGrid* previous;
+		const openvdb::math::Transform* transform;
+		bool sameTransform;
+		PressureVector* x;
+
+		void operator()(const VIndexTree::LeafNodeType& leaf, size_t) const
+		{
+			openvdb::FloatGrid::ConstAccessor accessor = previous->getConstAccessor();
+			PressureSampler sampler(accessor, previous->transform());
+			for (VIndexTree::LeafNodeType::ValueOnCIter it = leaf.cbeginValueOn(); it; ++it) {
+				const openvdb::Coord ijk = it.getCoord();
+				(*x)[*it] = PressureValueType(sameTransform ? accessor.getValue(ijk) : sampler.wsSample(transform->indexToWorld(ijk)));
+			}
+		}
+	};
+
+
+	   /// Constant boundary condition functor
+	struct DirichletOp {
+		inline void operator()(const openvdb::Coord&,
+			const openvdb::Coord&, double&, double& diag) const {
+			diag -= 1;
+		}
+	};
+
+
+	/// Divergence the pressure solve removes: the tangential divergence of the velocity plus the
+	/// external divergence, which has to be on the band already (see resampleOnBand). The band
+	/// of the result is the active voxels of the velocity.
+	inline void surfaceDivergence(const openvdb::Vec3SGrid& velocityGrid, const openvdb::Vec3SGrid& gradient_grid,
+		const openvdb::FloatGrid* externalOnBand, openvdb::FloatGrid& divergence)
+	{
+		tangentialDivergence(velocityGrid, gradient_grid, divergence);
+		if (!externalOnBand) return;
+
+		typedef openvdb::tree::LeafManager<openvdb::FloatTree> DivergenceLeafManager;
+		DivergenceLeafManager divergenceLeaves(divergence.tree());
+		const openvdb::FloatTree& externalTree = externalOnBand->tree();
+		tbb::parallel_for(divergenceLeaves.leafRange(), [&](const DivergenceLeafManager::LeafRange& range) {
+			openvdb::tree::ValueAccessor<const openvdb::FloatTree> external(externalTree);
+			for (DivergenceLeafManager::LeafRange::Iterator leafIter = range.begin(); leafIter; ++leafIter) {
+				for (openvdb::FloatTree::LeafNodeType::ValueOnIter it = leafIter->beginValueOn(); it; ++it) {
+					it.setValue(*it + external.getValue(it.getCoord()));
+				}
+			}
+		});
+	}
+
+	/// Solves for the pressure of divergence and subtracts its tangential gradient from the
+	/// velocity. The steps of poisson::solveWithBoundaryConditionsAndPreconditioner, but the
+	/// solution vector and the index tree are kept so the correction can read the pressure from
+	/// them, and the operator of matrixCache is reused while the band and the normals are unchanged.
+	///
+	/// x is the initial guess and returns the pressure. It is kept when the band topology of the
+	/// last solve with matrixCache is still valid, so consecutive substeps warm start from each
+	/// other. Otherwise it starts from previousPressure, or from zero without one. Returns the
+	/// final state of the PCG iteration.
+	template<typename InterrupterT>
+	inline openvdb::math::pcg::State solvePressure(openvdb::Vec3SGrid& velocityGrid, const openvdb::Vec3SGrid& gradient_grid,
+		const openvdb::FloatGrid& divergence, const PressureSolveParms& parms, PressureMatrixCache& matrixCache,
+		bool& preconditionerFallback, const openvdb::FloatGrid* previousPressure, PressureVector& x, InterrupterT& interrupter)
+	{
+		typedef openvdb::Vec3SGrid::TreeType       myVectorTreeType;
+		typedef myVectorTreeType::LeafNodeType   myVectorLeafNodeType;
+		typedef openvdb::Vec3SGrid::ValueType      myVectorType;
+		typedef myVectorType::ValueType          myVectorElementType;
+
+		openvdb::math::pcg::State state = openvdb::math::pcg::terminationDefaults<myVectorElementType>();
+		state.iterations = parms.iterations;
+		state.relativeError = state.absoluteError = openvdb::math::Delta<myVectorElementType>::value();
+
+		typedef openvdb::math::pcg::JacobiPreconditioner<openvdb::tools::poisson::LaplacianMatrix> PCT;
+		typedef openvdb::math::pcg::IncompleteCholeskyPreconditioner<openvdb::tools::poisson::LaplacianMatrix> ICT;
+
+		const int laplacianMode = parms.laplacianMode;
+		const bool matrixFree = parms.matrixFree;
+		const BandTopology::Ptr previousTopology = matrixCache.topology;
+		BandTopology& topology = matrixCache.bandTopology(divergence.tree());
+		// the operator reads the normals by index coordinate, unlike the divergence and the
+		// correction, which sample the gradient in world space
+		const openvdb::Vec3STree::ConstPtr normalTree = laplacianMode == LAPLACIAN_SURFACE ?
+			matrixCache.bandNormals(gradient_grid, velocityGrid.transform()) : gradient_grid.constTreePtr();
+		const bool keepGuess = !previousPressure && previousTopology.get() == &topology && x.size() == topology.size();
+		if (!matrixCache.matches(laplacianMode, matrixFree, normalTree)) {
+			matrixCache.clearOperator();
+			matrixCache.normals = normalTree;
+			matrixCache.mode = laplacianMode;
+			matrixCache.matrixFree = matrixFree;
+		}
+		if (matrixFree && !matrixCache.stencil) {
+			matrixCache.stencil.reset(new SurfaceStencil(topology.idxTree, laplacianMode == LAPLACIAN_SURFACE ? normalTree.get() : NULL));
+		}
+		if (!matrixFree && !matrixCache.laplacian) {
+			const VIndexTree& idxTree = *topology.idxTree;
+			PressureVector source(topology.size(), openvdb::zeroVal<PressureValueType>());
+			if (laplacianMode == LAPLACIAN_SURFACE) {
+				matrixCache.laplacian = openvdb::tools::poisson::createISLaplacianWithBoundaryConditions2D(
+					idxTree, topology.interiorMask(), DirichletOp(), *normalTree, source, /*staggered=*/false);
+			}
+			else {
+				matrixCache.laplacian = openvdb::tools::poisson::createISLaplacianWithBoundaryConditions(
+					idxTree, topology.interiorMask(), DirichletOp(), source);
+			}
+			matrixCache.laplacian->scale(-1.0); // matrix is negative-definite; solve -M x = -b
+		}
+		const VIndexTree::ConstPtr idxTree = topology.idxTree;
+		const openvdb::tools::poisson::LaplacianMatrix::Ptr laplacian = matrixCache.laplacian;
+		PressureVector::Ptr b = openvdb::tools::poisson::createVectorFromTree<PressureValueType>(divergence.tree(), *idxTree);
+		b->scale(-1.0);
+		if (!keepGuess) {
+			x.resize(b->size());
+			x.fill(openvdb::zeroVal<PressureValueType>());
+			if (previousPressure) {
+				openvdb::tree::LeafManager<const VIndexTree> idxLeaves(*idxTree);
+				WarmStartOp warmStartOp = { previousPressure, &velocityGrid.transform(),
+					previousPressure->transform() == velocityGrid.transform(), &x };
+				idxLeaves.foreach(warmStartOp);
+			}
+		}
+
+		preconditionerFallback = false;
+		if (matrixFree) {
+			// nothing but the diagonal is known without assembling the matrix
+			preconditionerFallback = parms.preconditionerMode != PRECONDITIONER_JACOBI;
+			if (parms.mixedPrecision) {
+				state = solveMixedPrecision(*matrixCache.stencil, *b, x, interrupter, state, parms.refinementSteps);
+			}
+			else {
+				state = solveMatrixFree(*matrixCache.stencil, *b, x, interrupter, state);
+			}
+		}
+		else {
+			// the preconditioner only depends on the matrix, so it is rebuilt together with it
+			const int preconditionerMode = parms.preconditionerMode;
+			if (!matrixCache.preconditioner || matrixCache.preconditionerMode != preconditionerMode) {
+				PressureMatrixCache::PreconditionerT::Ptr precond;
+				switch (preconditionerMode) {
+				case PRECONDITIONER_INCOMPLETE_CHOLESKY: precond.reset(new ICT(*laplacian)); break;
+				case PRECONDITIONER_MULTIGRID: precond.reset(new MultigridPreconditioner(*laplacian, idxTree)); break;
+				default: break;
+				}
+				if (precond && !precond->isValid()) {
+					preconditionerFallback = true;
+					precond.reset();
+				}
+				if (!precond) precond.reset(new PCT(*laplacian));
+				matrixCache.preconditioner = precond;
+				matrixCache.preconditionerMode = preconditionerFallback ? -1 : preconditionerMode;
+			}
+			state = openvdb::math::pcg::solve(*laplacian, *b, x, *matrixCache.preconditioner, interrupter, state);
+		}
+
+		{
+			std::vector<myVectorLeafNodeType*> velocityNodes;
+			velocityGrid.tree().getNodes(velocityNodes);
+
+			const double dx = velocityGrid.transform().voxelSize()[0];
+
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, velocityNodes.size()),
+				CorrectVelocityOp<myVectorTreeType>(&velocityNodes[0], *idxTree, x, gradient_grid, velocityGrid.transform(), dx));
+		}
+
+		return state;
+	}
+
+	/// The pressure of x as a grid on the band of the last solve with matrixCache
+	inline openvdb::FloatGrid::Ptr pressureGrid(const PressureVector& x, const PressureMatrixCache& matrixCache,
+		const openvdb::math::Transform& transform)
+	{
+		openvdb::FloatGrid::Ptr pressure = openvdb::FloatGrid::create(
+			openvdb::tools::poisson::createTreeFromVector<float>(x, *matrixCache.topology->idxTree, /*background=*/0.0f));
+		pressure->setTransform(transform.copy());
+		pressure->setGridClass(openvdb::GRID_UNKNOWN);
+		return pressure;
+	}
+
+	/// One pressure projection: the divergence of the velocity and the external divergence is
+	/// removed, the external divergence is resampled onto the band first
+	template<typename InterrupterT>
+	inline bool removeDivergence(openvdb::Vec3SGrid::Ptr velocityGrid, openvdb::Vec3SGrid::ConstPtr gradient_grid, openvdb::FloatGrid::ConstPtr external_divergencegrid,
+		const PressureSolveParms& parms, PressureMatrixCache& matrixCache, bool& preconditionerFallback,
+		openvdb::FloatGrid::ConstPtr previousPressure, openvdb::FloatGrid::Ptr* pressureOut, InterrupterT& interrupter)
+	{
+		openvdb::FloatGrid::Ptr divergence = openvdb::FloatGrid::create(*velocityGrid);
+		// the external divergence on the band, its own tree when it already shares the velocity transform
+		const openvdb::FloatGrid::ConstPtr external_divGrid_transformed =
+			resampleOnBand<openvdb::FloatGrid>(external_divergencegrid, velocityGrid->transform(), velocityGrid->tree());
+		surfaceDivergence(*velocityGrid, *gradient_grid, external_divGrid_transformed.get(), *divergence);
+
+		PressureVector x;
+		const bool success = solvePressure(*velocityGrid, *gradient_grid, *divergence, parms, matrixCache,
+			preconditionerFallback, previousPressure.get(), x, interrupter).success;
+		if (pressureOut) *pressureOut = pressureGrid(x, matrixCache, velocityGrid->transform());
+		return success;
+	}
+}
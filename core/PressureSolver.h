@@ -0,0 +1,415 @@
+#pragma once
+#include <openvdb/openvdb.h>
+#include <openvdb/math/ConjGradient.h>
+#include <openvdb/tools/PoissonSolver.h>
+#include <openvdb/tree/LeafManager.h>
+#include <PoissonSolver2D.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+namespace VdbCappucino {
+
+	/// Dot product accumulated in double whatever the precision of the vectors
+	template<typename T>
+	inline double dotProduct(const openvdb::math::pcg::Vector<T>& a, const openvdb::math::pcg::Vector<T>& b)
+	{
+		typedef openvdb::math::pcg::SizeType SizeType;
+		return tbb::parallel_reduce(tbb::blocked_range<SizeType>(0, a.size()), 0.0,
+			[&](const tbb::blocked_range<SizeType>& range, double sum) {
+				for (SizeType i = range.begin(); i < range.end(); ++i) sum += double(a[i]) * double(b[i]);
+				return sum;
+			}, [](double x, double y) { return x + y; });
+	}
+
+	/// a.D b for a diagonal matrix D, accumulated in double
+	template<typename T>
+	inline double dotProduct(const openvdb::math::pcg::Vector<T>& a, const openvdb::math::pcg::Vector<T>& d, const openvdb::math::pcg::Vector<T>& b)
+	{
+		typedef openvdb::math::pcg::SizeType SizeType;
+		return tbb::parallel_reduce(tbb::blocked_range<SizeType>(0, a.size()), 0.0,
+			[&](const tbb::blocked_range<SizeType>& range, double sum) {
+				for (SizeType i = range.begin(); i < range.end(); ++i) sum += double(a[i]) * double(d[i]) * double(b[i]);
+				return sum;
+			}, [](double x, double y) { return x + y; });
+	}
+
+	template<typename T>
+	inline double infNorm(const openvdb::math::pcg::Vector<T>& a)
+	{
+		typedef openvdb::math::pcg::SizeType SizeType;
+		return tbb::parallel_reduce(tbb::blocked_range<SizeType>(0, a.size()), 0.0,
+			[&](const tbb::blocked_range<SizeType>& range, double norm) {
+				for (SizeType i = range.begin(); i < range.end(); ++i) norm = std::max(norm, std::abs(double(a[i])));
+				return norm;
+			}, [](double x, double y) { return std::max(x, y); });
+	}
+
+	/// Matrix free version of the pressure matrix, the same operator as the negated
+	/// createISLaplacianWithBoundaryConditions2D() (or the stock Laplacian when built without normals)
+	/// with Dirichlet boundaries. Instead of seven columns and values per row it keeps the three axis
+	/// weights of every dof and, per leaf of the index tree, the six face neighbouring leaves, so a
+	/// multiplication walks the band leaf by leaf with the 512 voxels of a leaf as tile.
+	/// Like the assembled matrix, every face is weighted by surfaceFaceWeight() of the normals on its
+	/// two sides, so the operator is symmetric. Each dof keeps the weights of its three upper faces,
+	/// the lower ones are those of the neighbour. The weights are stored as float, the vectors may be
+	/// float or double, rows are always summed up in double.
+	class SurfaceStencil {
+	public:
+		typedef std::shared_ptr<SurfaceStencil> Ptr;
+		typedef openvdb::tools::poisson::LaplacianMatrix::ValueType ValueType;
+		typedef openvdb::math::pcg::Vector<ValueType> VectorT;
+		typedef openvdb::math::pcg::SizeType SizeType;
+		typedef openvdb::FloatTree::ValueConverter<openvdb::tools::poisson::VIndex>::Type VIndexTree;
+		typedef VIndexTree::LeafNodeType VIndexLeaf;
+
+		/// @param normals  surface normals in the index space of the band, NULL for the volume Laplacian
+		SurfaceStencil(const VIndexTree::ConstPtr& idxTree, const openvdb::Vec3STree* normals) :
+			mIdxTree(idxTree), mSize(SizeType(idxTree->activeVoxelCount()))
+		{
+			openvdb::tree::LeafManager<const VIndexTree> leaves(*mIdxTree);
+			mLeaves.resize(leaves.leafCount());
+			if (normals) mWeights.resize(size_t(mSize));
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, leaves.leafCount()), [&](const tbb::blocked_range<size_t>& range) {
+				openvdb::tree::ValueAccessor<const VIndexTree> idx(*mIdxTree);
+				std::unique_ptr<openvdb::tree::ValueAccessor<const openvdb::Vec3STree> > normal;
+				if (normals) normal.reset(new openvdb::tree::ValueAccessor<const openvdb::Vec3STree>(*normals));
+				for (size_t n = range.begin(); n < range.end(); ++n) {
+					const VIndexLeaf& leaf = leaves.leaf(n);
+					Leaf& block = mLeaves[n];
+					block.leaf = &leaf;
+					const openvdb::Coord origin = leaf.origin();
+					for (int dir = 0; dir < 6; ++dir) {
+						block.neighbours[dir] = idx.probeConstLeaf(origin + int(VIndexLeaf::DIM) * faceOffset(dir));
+					}
+					if (!normal) continue;
+					for (VIndexLeaf::ValueOnCIter it = leaf.cbeginValueOn(); it; ++it) {
+						const openvdb::Coord ijk = it.getCoord();
+						const openvdb::Vec3s n = normal->getValue(ijk);
+						openvdb::Vec3s& weights = mWeights[*it];
+						for (int axis = 0; axis < 3; ++axis) {
+							openvdb::Coord upper = ijk;
+							upper[axis] += 1;
+							weights[axis] = openvdb::tools::poisson::surfaceFaceWeight(n, normal->getValue(upper), axis);
+						}
+					}
+				}
+			});
+		}
+
+		SizeType numRows() const { return mSize; }
+		SizeType size() const { return mSize; }
+		const VIndexTree::ConstPtr& indexTree() const { return mIdxTree; }
+
+		/// y = A x
+		template<typename T>
+		void vectorMultiply(const openvdb::math::pcg::Vector<T>& x, openvdb::math::pcg::Vector<T>& y) const
+		{
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, mLeaves.size()), [&](const tbb::blocked_range<size_t>& range) {
+				for (size_t n = range.begin(); n < range.end(); ++n) {
+					forEachRow(mLeaves[n], [&](SizeType row, const SizeType* columns, const float* weights) {
+						ValueType diagonal = 0, sum = 0;
+						for (int dir = 0; dir < 6; ++dir) {
+							if (columns[dir] == INVALID) {
+								diagonal += ValueType(1);
+							}
+							else {
+								diagonal += weights[dir];
+								sum += weights[dir] * x[columns[dir]];
+							}
+						}
+						y[row] = T(diagonal * x[row] - sum);
+					});
+				}
+			});
+		}
+
+		/// First sweep of the fused PCG iteration: p = D^-1 r + beta pPrevious and q = A p in one pass,
+		/// the neighbouring entries of p are recomputed from r and pPrevious instead of being read
+		/// back. Returns p.q accumulated in double.
+		template<typename T>
+		double searchDirectionMultiply(const openvdb::math::pcg::Vector<T>& r, const openvdb::math::pcg::Vector<T>& invDiagonal,
+			const openvdb::math::pcg::Vector<T>& pPrevious, T beta, openvdb::math::pcg::Vector<T>& p, openvdb::math::pcg::Vector<T>& q) const
+		{
+			return tbb::parallel_reduce(tbb::blocked_range<size_t>(0, mLeaves.size()), 0.0,
+				[&](const tbb::blocked_range<size_t>& range, double pq) {
+					for (size_t n = range.begin(); n < range.end(); ++n) {
+						forEachRow(mLeaves[n], [&](SizeType row, const SizeType* columns, const float* weights) {
+							const T pRow = invDiagonal[row] * r[row] + beta * pPrevious[row];
+							ValueType diagonal = 0, sum = 0;
+							for (int dir = 0; dir < 6; ++dir) {
+								if (columns[dir] == INVALID) {
+									diagonal += ValueType(1);
+								}
+								else {
+									const SizeType column = columns[dir];
+									diagonal += weights[dir];
+									sum += weights[dir] * (invDiagonal[column] * r[column] + beta * pPrevious[column]);
+								}
+							}
+							const T qRow = T(diagonal * pRow - sum);
+							p[row] = pRow;
+							q[row] = qRow;
+							pq += double(pRow) * double(qRow);
+						});
+					}
+					return pq;
+				}, [](double a, double b) { return a + b; });
+		}
+
+		/// Inverse of the diagonal, for Jacobi preconditioning
+		template<typename T>
+		void invDiagonal(openvdb::math::pcg::Vector<T>& d) const
+		{
+			d.resize(mSize);
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, mLeaves.size()), [&](const tbb::blocked_range<size_t>& range) {
+				for (size_t n = range.begin(); n < range.end(); ++n) {
+					forEachRow(mLeaves[n], [&](SizeType row, const SizeType* columns, const float* weights) {
+						ValueType diagonal = 0;
+						for (int dir = 0; dir < 6; ++dir) diagonal += columns[dir] == INVALID ? ValueType(1) : ValueType(weights[dir]);
+						d[row] = diagonal != ValueType(0) ? T(ValueType(1) / diagonal) : T(0);
+					});
+				}
+			});
+		}
+
+	private:
+		static const SizeType INVALID = ~SizeType(0);
+
+		struct Leaf {
+			const VIndexLeaf* leaf;
+			const VIndexLeaf* neighbours[6];	// -x, +x, -y, +y, -z, +z, NULL where the band has no leaf
+		};
+
+		static openvdb::Coord faceOffset(int dir)
+		{
+			openvdb::Coord offset(0, 0, 0);
+			offset[dir >> 1] = (dir & 1) ? 1 : -1;
+			return offset;
+		}
+
+		/// Calls op(row, columns[6], weights[6]) for every dof of the leaf, missing neighbours are
+		/// INVALID and their weight is unused. The weight of a lower face is read from the neighbour.
+		template<typename RowOp>
+		void forEachRow(const Leaf& block, const RowOp& op) const
+		{
+			const VIndexLeaf& leaf = *block.leaf;
+			const int dim = int(VIndexLeaf::DIM);
+			const openvdb::Index strides[3] = { VIndexLeaf::DIM * VIndexLeaf::DIM, VIndexLeaf::DIM, 1 };
+			SizeType columns[6];
+			float weights[6] = { 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f };
+			for (VIndexLeaf::ValueOnCIter it = leaf.cbeginValueOn(); it; ++it) {
+				const openvdb::Index pos = it.pos();
+				const openvdb::Coord local = VIndexLeaf::offsetToLocalCoord(pos);
+				for (int dir = 0; dir < 6; ++dir) {
+					const int axis = dir >> 1;
+					const bool up = (dir & 1) != 0;
+					const VIndexLeaf* target = &leaf;
+					openvdb::Index offset;
+					if (up ? local[axis] < dim - 1 : local[axis] > 0) {
+						offset = up ? pos + strides[axis] : pos - strides[axis];
+					}
+					else {
+						// wraps around to the opposite face of the neighbouring leaf
+						target = block.neighbours[dir];
+						offset = up ? pos - (dim - 1) * strides[axis] : pos + (dim - 1) * strides[axis];
+					}
+					columns[dir] = (target && target->isValueOn(offset)) ? SizeType(target->getValue(offset)) : INVALID;
+					if (!mWeights.empty()) {
+						if (up) weights[dir] = mWeights[*it][axis];
+						else if (columns[dir] != INVALID) weights[dir] = mWeights[columns[dir]][axis];
+					}
+				}
+				op(SizeType(*it), columns, weights);
+			}
+		}
+
+		VIndexTree::ConstPtr mIdxTree;
+		SizeType mSize;
+		std::vector<Leaf> mLeaves;
+		std::vector<openvdb::Vec3s> mWeights;	// weights of the +x, +y, +z faces, empty for the volume Laplacian
+	};
+
+
+	/// Jacobi preconditioned conjugate gradient on a matrix free operator, with the termination
+	/// criteria of math::pcg::solve(): the infinity norm of the residual, absolute and relative to b.
+	/// Works on float or double vectors, dot products and norms are accumulated in double.
+	/// Every iteration makes two passes over the band instead of one per vector operation: the
+	/// preconditioner, the direction update, the stencil and p.Ap in the operator's
+	/// searchDirectionMultiply(), then the updates of x and r together with r.z and the norm.
+	template<typename T, typename OperatorT, typename Interrupter>
+	inline openvdb::math::pcg::State
+		solveMatrixFree(const OperatorT& A, const openvdb::math::pcg::Vector<T>& b, openvdb::math::pcg::Vector<T>& x,
+			Interrupter& interrupter, const openvdb::math::pcg::State& termination)
+	{
+		typedef double ValueType;
+		typedef openvdb::math::pcg::Vector<T> VectorT;
+		typedef openvdb::math::pcg::SizeType SizeType;
+
+		openvdb::math::pcg::State result;
+		result.success = false;
+		result.iterations = 0;
+		result.relativeError = 0.0;
+		result.absoluteError = 0.0;
+
+		const SizeType size = A.size();
+		if (b.size() != size || x.size() != size) {
+			OPENVDB_THROW(openvdb::ArithmeticError, "matrix and vector dimensions do not match");
+		}
+
+		const ValueType bNorm = infNorm(b);
+		if (openvdb::math::isExactlyEqual(bNorm, ValueType(0))) {
+			result.success = true;
+			return result;
+		}
+
+		VectorT invDiagonal, r(size), q(size), p0(size, T(0)), p1(size, T(0));
+		A.invDiagonal(invDiagonal);
+
+		// r = b - A x
+		A.vectorMultiply(x, q);
+		tbb::parallel_for(tbb::blocked_range<SizeType>(0, size), [&](const tbb::blocked_range<SizeType>& range) {
+			for (SizeType i = range.begin(); i < range.end(); ++i) r[i] = b[i] - q[i];
+		});
+		ValueType rDotZ = dotProduct(r, invDiagonal, r);
+
+		// an exact initial guess, e.g. a warm start on an unchanged band, needs no iteration
+		result.absoluteError = infNorm(r);
+		result.relativeError = result.absoluteError / bNorm;
+		if (result.relativeError <= termination.relativeError || result.absoluteError <= termination.absoluteError) {
+			result.success = true;
+			return result;
+		}
+
+		// two sweeps per iteration, the search direction is double buffered because the
+		// first sweep reads the neighbours of the previous direction while writing the new one
+		VectorT* p = &p0;
+		VectorT* pPrevious = &p1;
+		ValueType rDotZPrev = ValueType(1);
+		int iteration = 0;
+		for (; iteration < termination.iterations; ++iteration) {
+			if (interrupter.wasInterrupted()) {
+				OPENVDB_THROW(openvdb::RuntimeError, "conjugate gradient solver was interrupted");
+			}
+
+			// p = D^-1 r + beta p, q = A p
+			const T beta = iteration == 0 ? T(0) : T(rDotZ / rDotZPrev);
+			std::swap(p, pPrevious);
+			const ValueType pAp = A.searchDirectionMultiply(r, invDiagonal, *pPrevious, beta, *p, q);
+			if (openvdb::math::isExactlyEqual(pAp, ValueType(0))) break;
+			const T alpha = T(rDotZ / pAp);
+			rDotZPrev = rDotZ;
+
+			// x += alpha p, r -= alpha q, along with r.D^-1 r and the residual norm
+			const VectorT& direction = *p;
+			const std::pair<double, double> reduced = tbb::parallel_reduce(tbb::blocked_range<SizeType>(0, size),
+				std::pair<double, double>(0.0, 0.0),
+				[&](const tbb::blocked_range<SizeType>& range, std::pair<double, double> sums) {
+					for (SizeType i = range.begin(); i < range.end(); ++i) {
+						x[i] += alpha * direction[i];
+						const T ri = r[i] - alpha * q[i];
+						r[i] = ri;
+						sums.first += double(ri) * double(invDiagonal[i]) * double(ri);
+						sums.second = std::max(sums.second, std::abs(double(ri)));
+					}
+					return sums;
+				}, [](const std::pair<double, double>& a, const std::pair<double, double>& b) {
+					return std::pair<double, double>(a.first + b.first, std::max(a.second, b.second));
+				});
+			rDotZ = reduced.first;
+
+			const ValueType rNorm = reduced.second;
+			result.iterations = iteration + 1;
+			result.absoluteError = rNorm;
+			result.relativeError = rNorm / bNorm;
+			if (result.relativeError <= termination.relativeError || result.absoluteError <= termination.absoluteError) {
+				result.success = true;
+				break;
+			}
+		}
+		return result;
+	}
+
+
+	/// Mixed precision solve of A x = b: the PCG iterations run on float vectors, which halves the
+	/// memory traffic of the stencil sweeps. The first float solve and each of the refinementSteps
+	/// corrections after it solve for the residual of the double solution up to REFINEMENT_TOLERANCE
+	/// and add the result to x, until the termination criteria hold for the double residual. Without
+	/// refinement the float solution is returned as is. All solves share the iteration budget of the
+	/// termination state.
+	template<typename OperatorT, typename Interrupter>
+	inline openvdb::math::pcg::State
+		solveMixedPrecision(const OperatorT& A, const openvdb::math::pcg::Vector<double>& b, openvdb::math::pcg::Vector<double>& x,
+			Interrupter& interrupter, const openvdb::math::pcg::State& termination, int refinementSteps)
+	{
+		typedef openvdb::math::pcg::Vector<float> FloatVector;
+		typedef openvdb::math::pcg::SizeType SizeType;
+		static const double REFINEMENT_TOLERANCE = 1.0e-4;
+
+		const SizeType size = A.size();
+		if (b.size() != size || x.size() != size) {
+			OPENVDB_THROW(openvdb::ArithmeticError, "matrix and vector dimensions do not match");
+		}
+
+		openvdb::math::pcg::State result;
+		const double bNorm = infNorm(b);
+		if (openvdb::math::isExactlyEqual(bNorm, 0.0)) {
+			result.success = true;
+			result.iterations = 0;
+			result.relativeError = result.absoluteError = 0.0;
+			return result;
+		}
+
+		FloatVector bFloat(size), xFloat(size);
+		if (refinementSteps <= 0) {
+			tbb::parallel_for(tbb::blocked_range<SizeType>(0, size), [&](const tbb::blocked_range<SizeType>& range) {
+				for (SizeType i = range.begin(); i < range.end(); ++i) {
+					bFloat[i] = float(b[i]);
+					xFloat[i] = float(x[i]);
+				}
+			});
+			result = solveMatrixFree(A, bFloat, xFloat, interrupter, termination);
+			tbb::parallel_for(tbb::blocked_range<SizeType>(0, size), [&](const tbb::blocked_range<SizeType>& range) {
+				for (SizeType i = range.begin(); i < range.end(); ++i) x[i] = double(xFloat[i]);
+			});
+			return result;
+		}
+
+		openvdb::math::pcg::Vector<double> r(size);
+		openvdb::math::pcg::State inner = termination;
+		inner.relativeError = std::max(termination.relativeError, REFINEMENT_TOLERANCE);
+		result.iterations = 0;
+		// the initial float solve plus refinementSteps corrections, the last residual is only checked
+		for (int step = 0; step <= refinementSteps + 1; ++step) {
+			// r = b - A x in double, the float solve only ever sees the residual
+			A.vectorMultiply(x, r);
+			tbb::parallel_for(tbb::blocked_range<SizeType>(0, size), [&](const tbb::blocked_range<SizeType>& range) {
+				for (SizeType i = range.begin(); i < range.end(); ++i) r[i] = b[i] - r[i];
+			});
+			result.absoluteError = infNorm(r);
+			result.relativeError = result.absoluteError / bNorm;
+			result.success = result.relativeError <= termination.relativeError || result.absoluteError <= termination.absoluteError;
+			inner.iterations = termination.iterations - result.iterations;
+			if (result.success || step == refinementSteps + 1 || inner.iterations <= 0) break;
+
+			tbb::parallel_for(tbb::blocked_range<SizeType>(0, size), [&](const tbb::blocked_range<SizeType>& range) {
+				for (SizeType i = range.begin(); i < range.end(); ++i) {
+					bFloat[i] = float(r[i]);
+					xFloat[i] = 0.0f;
+				}
+			});
+			const openvdb::math::pcg::State correction = solveMatrixFree(A, bFloat, xFloat, interrupter, inner);
+			result.iterations += correction.iterations;
+			tbb::parallel_for(tbb::blocked_range<SizeType>(0, size), [&](const tbb::blocked_range<SizeType>& range) {
+				for (SizeType i = range.begin(); i < range.end(); ++i) x[i] += double(xFloat[i]);
+			});
+			if (correction.iterations == 0) break;
+		}
+		return result;
+	}
+}
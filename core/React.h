@@ -0,0 +1,128 @@
+#pragma once
+#include <openvdb/openvdb.h>
+#include <openvdb/tree/LeafManager.h>
+#include <tbb/parallel_for.h>
+
+namespace VdbCappucino {
+
+	struct GrayScottParms {
+		float feed;
+		float kill;
+		float delta;
+		float diffrate;
+	};
+
+	/// One Gray-Scott reaction diffusion step on the u (x) and v (y) channel of a color grid.
+	/// Every leaf is gathered together with a one voxel halo into a 10^3 buffer per channel,
+	/// the 12 neighbour Laplacian then runs on contiguous memory. The result goes into
+	/// auxiliary buffer 1 of the LeafManager, so the source leaves stay untouched while
+	/// neighbouring leaves still read them.
+	class GrayScottOp {
+	public:
+		typedef openvdb::Vec3STree TreeT;
+		typedef TreeT::LeafNodeType LeafT;
+		typedef openvdb::tree::LeafManager<TreeT> LeafManagerT;
+
+		static const int DIM = LeafT::DIM;
+		static const int HALO_DIM = DIM + 2;
+		static const int HALO_SIZE = HALO_DIM * HALO_DIM * HALO_DIM;
+
+		GrayScottOp(const LeafManagerT& leafManager, const GrayScottParms& parms) :
+			mTree(&leafManager.tree()), mParms(parms) {}
+
+		void operator()(const LeafManagerT::LeafRange& range) const
+		{
+			openvdb::tree::ValueAccessor<const TreeT> accessor(*mTree);
+			float u[HALO_SIZE], v[HALO_SIZE];
+			float lapU[DIM], lapV[DIM];
+
+			// 12 edge neighbours as offsets into the halo buffer
+			const int dx = HALO_DIM * HALO_DIM, dy = HALO_DIM, dz = 1;
+			const int offsets[12] = {
+				-dx - dy, -dx + dy, dx - dy, dx + dy,
+				-dx - dz, -dx + dz, dx - dz, dx + dz,
+				-dy - dz, -dy + dz, dy - dz, dy + dz };
+
+			for (LeafManagerT::LeafRange::Iterator leafIter = range.begin(); leafIter; ++leafIter) {
+				const LeafT& leaf = *leafIter;
+				gather(accessor, leaf, u, v);
+
+				LeafT::Buffer& result = leafIter.buffer(1);
+				for (int i = 0; i < DIM; ++i) {
+					for (int j = 0; j < DIM; ++j) {
+						const int row = ((i + 1) * HALO_DIM + (j + 1)) * HALO_DIM + 1;
+						for (int k = 0; k < DIM; ++k) {
+							lapU[k] = -12.0f * u[row + k];
+							lapV[k] = -12.0f * v[row + k];
+						}
+						for (int n = 0; n < 12; ++n) {
+							const float* un = u + row + offsets[n];
+							const float* vn = v + row + offsets[n];
+							for (int k = 0; k < DIM; ++k) {
+								lapU[k] += un[k];
+								lapV[k] += vn[k];
+							}
+						}
+						const openvdb::Index base = (i << (2 * LeafT::LOG2DIM)) + (j << LeafT::LOG2DIM);
+						for (int k = 0; k < DIM; ++k) {
+							if (!leaf.isValueOn(base + k)) continue;
+							result.setValue(base + k, react(u[row + k], v[row + k], lapU[k], lapV[k]));
+						}
+					}
+				}
+			}
+		}
+
+	private:
+		// copy the leaf into the interior of the halo buffer and fetch the halo through the accessor
+		void gather(openvdb::tree::ValueAccessor<const TreeT>& accessor, const LeafT& leaf, float* u, float* v) const
+		{
+			const openvdb::Coord origin = leaf.origin() - openvdb::Coord(1);
+			openvdb::Coord ijk;
+			int n = 0;
+			for (int i = 0; i < HALO_DIM; ++i) {
+				ijk[0] = origin[0] + i;
+				const bool haloI = (i == 0 || i == HALO_DIM - 1);
+				for (int j = 0; j < HALO_DIM; ++j) {
+					ijk[1] = origin[1] + j;
+					const bool haloJ = haloI || (j == 0 || j == HALO_DIM - 1);
+					for (int k = 0; k < HALO_DIM; ++k, ++n) {
+						ijk[2] = origin[2] + k;
+						const bool halo = haloJ || (k == 0 || k == HALO_DIM - 1);
+						const openvdb::Vec3f& uv = halo ? accessor.getValue(ijk)
+							: leaf.getValue(LeafT::coordToOffset(ijk));
+						u[n] = uv.x();
+						v[n] = uv.y();
+					}
+				}
+			}
+		}
+
+		inline openvdb::Vec3f react(float uu, float vv, float lapx, float lapy) const
+		{
+			if (lapx < 0.0f) lapx = 0.0f;
+			if (lapy < 0.0f) lapy = 0.0f;
+			const float uvv = uu * vv * vv;
+			const float du = mParms.diffrate * lapx - uvv + mParms.feed * (1.0f - uu);
+			const float dv = mParms.diffrate * lapy + uvv - (mParms.feed + mParms.kill) * vv;
+			float u = uu + mParms.delta * du;
+			float v = vv + mParms.delta * dv;
+			if (u < 0.0f) u = 0.0f;
+			if (v < 0.0f) v = 0.0f;
+			if (u > 1.0f) u = 1.0f;
+			if (v > 1.0f) v = 1.0f;
+			return openvdb::Vec3f(u, v, 0.0f);
+		}
+
+		const TreeT* mTree;
+		GrayScottParms mParms;
+	};
+
+	/// Runs one Gray-Scott step. The leaf manager needs one auxiliary buffer,
+	/// after the step the new values are swapped into the tree.
+	inline void grayScottStep(GrayScottOp::LeafManagerT& leafManager, const GrayScottParms& parms)
+	{
+		tbb::parallel_for(leafManager.leafRange(), GrayScottOp(leafManager, parms));
+		leafManager.swapLeafBuffer(1);
+	}
+}
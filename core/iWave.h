@@ -0,0 +1,199 @@
+#pragma once
+#include <openvdb/openvdb.h>
+#include <openvdb/tree/LeafManager.h>
+#include <openvdb/tools/Prune.h>
+#include <tbb/parallel_for.h>
+#include <Convolve.h>
+#include <iWaveKernel.h>
+
+namespace VdbCappucino {
+
+	// modes of SOP_VdbWave, the order matches the "mode" menu
+	enum iWaveMode {
+		IWAVE_COPY = 0,	// deep copy Cd into Cd_old after the step
+		IWAVE_ROTATE,		// rotate Cd and Cd_old leaf by leaf in place
+		IWAVE_INTEGRATED	// vertical derivative from the analytic kernel, no second input
+	};
+
+	/// Coefficients of the iWave height update
+	/// h_new = ((2 - alpha dt) h - h_old - g dt^2 vd) / (1 + alpha dt)
+	struct iWaveCoefficients {
+		float gravity;		// g * dt^2
+		float adt2;			// 1 / (1 + alpha dt)
+		float twoMinusAdt;	// 2 - alpha dt
+
+		iWaveCoefficients(float gravityDt2, float adt) :
+			gravity(gravityDt2), adt2(1.0 / (1.0 + adt)), twoMinusAdt(2.0 - adt) {}
+
+		inline openvdb::Vec3f update(openvdb::Vec3f height, const openvdb::Vec3f& heightOld,
+			const openvdb::Vec3f& verticalDerivative) const
+		{
+			height *= twoMinusAdt;
+			height -= heightOld;
+			height -= gravity * verticalDerivative;
+			height *= adt2;
+			return height;
+		}
+	};
+
+	/// Height update of the copy mode. The previous heights and the vertical derivative are
+	/// looked up by coordinate, each task builds its own accessors to them.
+	class iWaveCopyOp {
+	public:
+		typedef openvdb::Vec3STree TreeT;
+		typedef TreeT::LeafNodeType LeafT;
+		typedef openvdb::tree::LeafManager<TreeT> LeafManagerT;
+
+		iWaveCopyOp(const openvdb::Vec3SGrid& heightOld, const openvdb::Vec3SGrid& verticalDerivative, const iWaveCoefficients& coefficients) :
+			mHeightOld(&heightOld), mVerticalDerivative(&verticalDerivative), mCoefficients(coefficients) {}
+
+		void operator()(const LeafManagerT::LeafRange& range) const
+		{
+			openvdb::Vec3SGrid::ConstAccessor heightOld = mHeightOld->getConstAccessor();
+			openvdb::Vec3SGrid::ConstAccessor verticalDerivative = mVerticalDerivative->getConstAccessor();
+			for (LeafManagerT::LeafRange::Iterator leafIter = range.begin(); leafIter; ++leafIter) {
+				openvdb::Vec3f* height = leafIter->buffer().data();
+				for (LeafT::ValueOnCIter iter = leafIter->cbeginValueOn(); iter; ++iter) {
+					const openvdb::Coord ijk = iter.getCoord();
+					const openvdb::Index n = iter.pos();
+					height[n] = mCoefficients.update(height[n], heightOld.getValue(ijk), verticalDerivative.getValue(ijk));
+				}
+			}
+		}
+
+	private:
+		const openvdb::Vec3SGrid* mHeightOld;
+		const openvdb::Vec3SGrid* mVerticalDerivative;
+		iWaveCoefficients mCoefficients;
+	};
+
+	/// Pairs every leaf of the height tree with the leaf at the same origin of the previous
+	/// height tree and rotates them in place: old <- current, current <- new.
+	class iWaveRotateOp {
+	public:
+		typedef openvdb::Vec3STree TreeT;
+		typedef TreeT::LeafNodeType LeafT;
+
+		iWaveRotateOp(TreeT& oldTree, const openvdb::Vec3SGrid& verticalDerivative, const iWaveCoefficients& coefficients) :
+			mOldTree(&oldTree), mVerticalDerivative(verticalDerivative.getConstAccessor()), mCoefficients(coefficients) {}
+
+		void operator()(LeafT& leaf, size_t) const
+		{
+			LeafT* oldLeaf = mOldTree->probeLeaf(leaf.origin());
+			openvdb::Vec3f* height = leaf.buffer().data();
+			openvdb::Vec3f* heightOld = oldLeaf->buffer().data();
+			for (LeafT::ValueOnCIter iter = leaf.cbeginValueOn(); iter; ++iter) {
+				const openvdb::Index n = iter.pos();
+				const openvdb::Vec3f current = height[n];
+				height[n] = mCoefficients.update(current, heightOld[n], mVerticalDerivative.getValue(iter.getCoord()));
+				heightOld[n] = current;
+			}
+			oldLeaf->setValueMask(leaf.getValueMask());
+		}
+
+	private:
+		TreeT* mOldTree;
+		openvdb::Vec3SGrid::ConstAccessor mVerticalDerivative;
+		iWaveCoefficients mCoefficients;
+	};
+
+	/// Computes the vertical derivative of the current heights with the analytic kernel for a
+	/// whole leaf brick and applies the height update in the same pass. The new heights go into
+	/// auxiliary buffer 1 while the neighbours still read the current ones, the previous height
+	/// leaf only belongs to this leaf and is rotated right away.
+	class iWaveIntegratedOp {
+	public:
+		typedef openvdb::Vec3STree TreeT;
+		typedef TreeT::LeafNodeType LeafT;
+		typedef openvdb::tree::LeafManager<TreeT> LeafManagerT;
+
+		iWaveIntegratedOp(const LeafManagerT& leafManager, TreeT& oldTree,
+			const BrickConvolver& convolver, const iWaveCoefficients& coefficients) :
+			mLeafManager(&leafManager), mOldTree(&oldTree), mHeight(leafManager.tree()),
+			mConvolver(&convolver), mCoefficients(coefficients) {}
+		iWaveIntegratedOp(const iWaveIntegratedOp& other) :
+			mLeafManager(other.mLeafManager), mOldTree(other.mOldTree), mHeight(other.mHeight),
+			mConvolver(other.mConvolver), mCoefficients(other.mCoefficients) {}
+
+		void operator()(LeafT& leaf, size_t leafIdx) const
+		{
+			mConvolver->gather(mHeight, leaf.origin(), mScratch);
+			mConvolver->convolve(mScratch);
+
+			LeafT* oldLeaf = mOldTree->probeLeaf(leaf.origin());
+			openvdb::Vec3f* height = leaf.buffer().data();
+			openvdb::Vec3f* heightOld = oldLeaf->buffer().data();
+			LeafT::Buffer& result = mLeafManager->getBuffer(leafIdx, 1);
+			for (LeafT::ValueOnCIter iter = leaf.cbeginValueOn(); iter; ++iter) {
+				const openvdb::Index n = iter.pos();
+				const openvdb::Vec3f verticalDerivative(mScratch.result[0][n], mScratch.result[1][n], mScratch.result[2][n]);
+				result.setValue(n, mCoefficients.update(height[n], heightOld[n], verticalDerivative));
+				heightOld[n] = height[n];
+			}
+			oldLeaf->setValueMask(leaf.getValueMask());
+		}
+
+	private:
+		const LeafManagerT* mLeafManager;
+		TreeT* mOldTree;
+		openvdb::tree::ValueAccessor<const TreeT> mHeight;
+		const BrickConvolver* mConvolver;
+		iWaveCoefficients mCoefficients;
+		mutable ConvolveScratch mScratch;
+	};
+
+	/// Prepares the previous height tree for a leaf paired update: every height leaf gets a
+	/// partner at the same origin and previous heights outside of the current band are dropped.
+	inline void pairLeaves(openvdb::Vec3STree& tree, openvdb::Vec3STree& oldTree)
+	{
+		typedef openvdb::Vec3STree TreeT;
+		tree.voxelizeActiveTiles();
+		for (TreeT::LeafCIter leafIter = tree.cbeginLeaf(); leafIter; ++leafIter) {
+			oldTree.touchLeaf(leafIter->origin());
+		}
+		for (TreeT::LeafIter leafIter = oldTree.beginLeaf(); leafIter; ++leafIter) {
+			if (!tree.probeConstLeaf(leafIter->origin())) leafIter->setValuesOff();
+		}
+	}
+
+	/// One iWave step of the copy mode, the caller keeps the pre-step heights for Cd_old.
+	/// Every voxel only reads its own height, so the leaves are updated in parallel in place.
+	inline void copyHeights(openvdb::Vec3SGrid& height, const openvdb::Vec3SGrid& heightOld,
+		const openvdb::Vec3SGrid& verticalDerivative, const iWaveCoefficients& coefficients)
+	{
+		// active tiles are made voxels with the same value, the leaf pass would skip them otherwise
+		height.tree().voxelizeActiveTiles();
+		iWaveCopyOp::LeafManagerT leafManager(height.tree());
+		tbb::parallel_for(leafManager.leafRange(), iWaveCopyOp(heightOld, verticalDerivative, coefficients));
+	}
+
+	/// One iWave step without any tree copy. Afterwards the previous height grid holds the
+	/// values of the height grid before the step, on the same active topology.
+	inline void rotateHeights(openvdb::Vec3SGrid& height, openvdb::Vec3SGrid& heightOld,
+		const openvdb::Vec3SGrid& verticalDerivative, const iWaveCoefficients& coefficients)
+	{
+		typedef iWaveRotateOp::TreeT TreeT;
+		pairLeaves(height.tree(), heightOld.tree());
+
+		openvdb::tree::LeafManager<TreeT> leafManager(height.tree());
+		leafManager.foreach(iWaveRotateOp(heightOld.tree(), verticalDerivative, coefficients));
+		openvdb::tools::pruneInactive(heightOld.tree());
+	}
+
+	/// One iWave step with the vertical derivative computed on the fly from the kernel table,
+	/// the derivative itself is never stored in a grid.
+	inline void integratedHeights(openvdb::Vec3SGrid& height, openvdb::Vec3SGrid& heightOld,
+		const iWaveKernelTable& kernelTable, const iWaveCoefficients& coefficients)
+	{
+		pairLeaves(height.tree(), heightOld.tree());
+
+		const int dim = kernelTable.parms().dim;
+		DenseKernel kernel(openvdb::Coord(-dim), openvdb::Coord(2 * dim), kernelTable.dense());
+		BrickConvolver convolver(kernel, CONVOLVE_BRICK);
+
+		iWaveIntegratedOp::LeafManagerT leafManager(height.tree(), 1);
+		leafManager.foreach(iWaveIntegratedOp(leafManager, heightOld.tree(), convolver, coefficients));
+		leafManager.swapLeafBuffer(1);
+		openvdb::tools::pruneInactive(heightOld.tree());
+	}
+}
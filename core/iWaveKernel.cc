@@ -0,0 +1,20 @@
+#include "iWaveKernel.h"
+#include <mutex>
+
+namespace VdbCappucino {
+
+	iWaveKernelTable::ConstPtr iWaveKernelCache::get(const iWaveKernelParms& parms)
+	{
+		static std::mutex mutex;
+		static std::map<iWaveKernelParms, iWaveKernelTable::ConstPtr> tables;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		std::map<iWaveKernelParms, iWaveKernelTable::ConstPtr>::const_iterator found = tables.find(parms);
+		if (found != tables.end()) return found->second;
+		// parameters get scrubbed interactively, don't let the cache grow without bounds
+		if (tables.size() >= MAX_TABLES) tables.clear();
+		iWaveKernelTable::ConstPtr table(new iWaveKernelTable(parms));
+		tables[parms] = table;
+		return table;
+	}
+}
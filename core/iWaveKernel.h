@@ -0,0 +1,166 @@
+#pragma once
+#include <openvdb/openvdb.h>
+#include <openvdb/tree/LeafManager.h>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace VdbCappucino {
+
+	struct iWaveKernelParms {
+		float sigma;
+		float dk;
+		float endk;
+		int dim;
+
+		bool operator==(const iWaveKernelParms& other) const
+		{
+			return sigma == other.sigma && dk == other.dk && endk == other.endk && dim == other.dim;
+		}
+		bool operator!=(const iWaveKernelParms& other) const { return !(*this == other); }
+		bool operator<(const iWaveKernelParms& other) const
+		{
+			if (dim != other.dim) return dim < other.dim;
+			if (sigma != other.sigma) return sigma < other.sigma;
+			if (dk != other.dk) return dk < other.dk;
+			return endk < other.endk;
+		}
+	};
+
+	/// Radial profile of the iWave vertical derivative kernel on the cube [-dim, dim)^3.
+	/// The taps only ever sit at integer squared radii, so the profile is tabulated exactly
+	/// by r^2 = i^2 + j^2 + k^2 and a 3D kernel is a pure table lookup.
+	class iWaveKernelTable {
+	public:
+		explicit iWaveKernelTable(const iWaveKernelParms& parms) : mParms(parms)
+		{
+			const int dim = parms.dim;
+			const double startK = parms.dk;
+			mNorm = 0;
+			for (double freq = startK; freq < parms.endk; freq += parms.dk)
+				// the original iWave kernel
+				mNorm += freq * freq * exp(-parms.sigma * freq * freq);
+
+			mProfile.assign(3 * dim * dim + 1, 0.0f);
+			for (size_t r2 = 1; r2 < mProfile.size(); ++r2) {
+				const double r = openvdb::math::Sqrt(double(r2));
+				double kern = 0;
+				for (double freq = startK; freq < parms.endk; freq += parms.dk)
+				{
+					double currentSinc = sin(r * freq) / (r * freq);
+					kern += freq * freq * freq * exp(-parms.sigma * freq * freq) * currentSinc;
+				}
+				double interp = cubic(((r / dim) - 0.9) / 0.1);
+				kern *= (interp / (openvdb::math::pi<double>() * mNorm));
+				mProfile[r2] = float(kern);
+			}
+
+			// the centre tap makes the y axis of the kernel sum up to 2
+			float sumOfY = 0.0f;
+			for (int j = -dim; j < +dim; ++j) sumOfY += (j == 0) ? 1.0f : mProfile[j * j];
+			mCenter = 2.0f - sumOfY;
+		}
+
+		typedef std::shared_ptr<const iWaveKernelTable> ConstPtr;
+
+		const iWaveKernelParms& parms() const { return mParms; }
+		double norm() const { return mNorm; }
+
+		/// sum of all taps except the centre one
+		double weight() const
+		{
+			const int dim = mParms.dim;
+			double weight = -mCenter;
+			for (int i = -dim; i < dim; ++i)
+				for (int j = -dim; j < dim; ++j)
+					for (int k = -dim; k < dim; ++k)
+						weight += value(i, j, k);
+			return weight;
+		}
+
+		/// kernel value at offset (i, j, k), each in [-dim, dim)
+		float value(int i, int j, int k) const
+		{
+			const int r2 = i * i + j * j + k * k;
+			return r2 == 0 ? mCenter : mProfile[r2];
+		}
+
+		/// the whole cube as a dense array, x major
+		std::vector<float> dense() const
+		{
+			const int dim = mParms.dim, width = 2 * mParms.dim;
+			std::vector<float> values(size_t(width) * width * width);
+			size_t n = 0;
+			for (int i = -dim; i < dim; ++i)
+				for (int j = -dim; j < dim; ++j)
+					for (int k = -dim; k < dim; ++k, ++n)
+						values[n] = value(i, j, k);
+			return values;
+		}
+
+		static double cubic(double interp)
+		{
+			if (interp < 0) return 1.0;
+			if (interp > 1) return 0;
+			double squared = interp * interp;
+			return 2 * squared * interp - 3 * squared + 1;
+		}
+
+	private:
+		iWaveKernelParms mParms;
+		double mNorm;
+		float mCenter;
+		std::vector<float> mProfile;
+	};
+
+	/// Process wide cache of kernel tables keyed by their parameters, shared by
+	/// VDB Wave Kernel and the integrated mode of VDB Wave.
+	class iWaveKernelCache {
+	public:
+		static iWaveKernelTable::ConstPtr get(const iWaveKernelParms& parms);
+
+	private:
+		static const size_t MAX_TABLES = 16;
+	};
+
+	/// Writes the kernel values of a table into the voxels of a leaf that fall inside the kernel cube
+	class iWaveKernelFillOp {
+	public:
+		typedef openvdb::FloatTree::LeafNodeType LeafT;
+
+		explicit iWaveKernelFillOp(const iWaveKernelTable& table) : mTable(&table),
+			mBox(openvdb::Coord(-table.parms().dim), openvdb::Coord(table.parms().dim - 1)) {}
+
+		void operator()(LeafT& leaf, size_t) const
+		{
+			for (openvdb::Index n = 0; n < LeafT::SIZE; ++n) {
+				const openvdb::Coord ijk = leaf.offsetToGlobalCoord(n);
+				if (mBox.isInside(ijk)) leaf.setValueOn(n, mTable->value(ijk[0], ijk[1], ijk[2]));
+			}
+		}
+
+	private:
+		const iWaveKernelTable* mTable;
+		openvdb::CoordBBox mBox;
+	};
+
+	/// Builds the kernel cube [-dim, dim)^3 as a float tree, all voxels of the cube are active.
+	/// The leaves are allocated up front and filled in parallel from the table.
+	inline openvdb::FloatTree::Ptr buildKernelTree(const iWaveKernelTable& table)
+	{
+		typedef iWaveKernelFillOp::LeafT LeafT;
+		openvdb::FloatTree::Ptr tree(new openvdb::FloatTree(0.0f));
+		const int dim = table.parms().dim;
+		const int mask = ~int(LeafT::DIM - 1);
+		openvdb::Coord origin;
+		for (origin[0] = -dim & mask; origin[0] < dim; origin[0] += LeafT::DIM)
+			for (origin[1] = -dim & mask; origin[1] < dim; origin[1] += LeafT::DIM)
+				for (origin[2] = -dim & mask; origin[2] < dim; origin[2] += LeafT::DIM)
+					tree->touchLeaf(origin);
+
+		openvdb::tree::LeafManager<openvdb::FloatTree> leafManager(*tree);
+		leafManager.foreach(iWaveKernelFillOp(table));
+		return tree;
+	}
+}
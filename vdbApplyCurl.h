@@ -7,6 +7,7 @@
 #include <openvdb/tools/Interpolation.h>
 #include <openvdb/tools/ValueTransformer.h>
 #include <openvdb/tools/GridTransformer.h>
+#include <openvdb/tools/Morphology.h>
 #include <Diverge.h>
 namespace VdbCappucino {
 	
@@ -29,7 +29,7 @@ namespace VdbCappucino {
 	private:
 		// helper function for returning value of parameter
 		int DEBUG() { return evalInt("debug", 0, 0); }
-		
+		int BACKEND() { return evalInt("backend", 0, 0); }
 
 	};
 
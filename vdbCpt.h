@@ -32,6 +32,7 @@ namespace VdbCappucino {
 		// helper function for returning value of parameter
 		int DEBUG() { return evalInt("debug", 0, 0); }
 		int DOWORLDCOORDS() { return evalInt("doworldpos", 0, 0); }
+		int PRUNEBAND() { return evalInt("pruneband", 0, 0); }
 		int INTERPOLATIONMETHOD() { return evalInt("interpolationmethod", 0, 0); }
 		fpreal MAXCELLS(fpreal t) { return evalFloat("maxcells", 0, t); }
 
@@ -45,6 +45,7 @@ SOP_VdbCrossProduct::cookMySop(OP_Context &context)
 		const fpreal time = context.getTime();
 
 		hvdb::Interrupter boss("CrossProduct");
+		const int interpolation = INTERPOLATION();
 
 
 		UT_String aGroupStr;
@@ -102,8 +103,7 @@ SOP_VdbCrossProduct::cookMySop(OP_Context &context)
 
 				std::string gridName = a_grid->getName();
 				// Iterate over all active values.
-
-				openvdb::tools::foreach(a_grid->beginValueOn(), CrossProduct(b_grid, a_grid->transform()), true, 0);
+				forEachLeafWithField<CrossProductOp>(*a_grid, *b_grid, interpolation);
 
 			}
 		}
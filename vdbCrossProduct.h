@@ -72,8 +72,9 @@ namespace VdbCappucino {
 		// main function that does geometry processing
 		virtual OP_ERROR cookMySop(OP_Context &context);
 
+	private:
+		int INTERPOLATION() { return evalInt("interpolation", 0, 0); }
 
-	
 
 	};
 
@@ -37,6 +37,7 @@ namespace VdbCappucino {
 		// helper function for returning value of parameter
 		int DEBUG() { return evalInt("debug", 0, 0); }
 		float DT() { return evalFloat("dt", 0, 0); }
+		int INTERPOLATION() { return evalInt("interpolation", 0, 0); }
 
 	};
 	
@@ -34,6 +34,7 @@ namespace VdbCappucino {
 		fpreal KILL(fpreal t) { return evalFloat("kill", 0, t); }
 		fpreal DELTA(fpreal t) { return evalFloat("delta", 0, t); }
 		fpreal DIFFRATE(fpreal t) { return evalFloat("diffrate", 0, t); }
+		int ITERATIONS(fpreal t) { return evalInt("iterations", 0, t); }
 	};
 
 
@@ -15,7 +15,8 @@ SOP_VdbRemove_Divergence::inputLabel(unsigned idx) const
 	switch (idx) {
 	case 0: return "velocity";
 	case 1: return "gradient of distancefield";
-	default: return "external divergence";
+	case 2: return "external divergence";
+	default: return "previous pressure";
 	}
 };
 
@@ -35,163 +36,6 @@ SOP_VdbRemove_Divergence::~SOP_VdbRemove_Divergence() {}
 
 
 
-namespace {
-
-
-	template<typename TreeType>
-	struct CorrectVelocityOp
-	{
-		typedef typename TreeType::LeafNodeType LeafNodeType;
-		typedef typename TreeType::ValueType    ValueType;
-
-		CorrectVelocityOp(LeafNodeType** velocityNodes, const openvdb::Vec3SGrid::Ptr gradientOfPressure, double dx)
-			: mVelocityNodes(velocityNodes), gradientOfPressure(gradientOfPressure), mVoxelSize(dx)
-		{
-		}
-
-		void operator()(const tbb::blocked_range<size_t>& range) const {
-
-			typedef typename ValueType::value_type ElementType;
-			const ElementType scale = ElementType(mVoxelSize * mVoxelSize);
-
-			for (size_t n = range.begin(), N = range.end(); n < N; ++n) {
-
-				LeafNodeType& velocityNode = *mVelocityNodes[n];
-				ValueType* velocityData = velocityNode.buffer().data();
-
-				//const ValueType* gradientOfPressureData = mGradientOfPressureNodes[n]->buffer().data();
-
-				for (typename LeafNodeType::ValueOnIter it = velocityNode.beginValueOn(); it; ++it) {
-					const openvdb::Index pos = it.pos();
-					const openvdb::math::Coord coord = it.getCoord();
-						velocityData[pos] -= scale * gradientOfPressure->getConstAccessor().getValue(coord);
-				}
-			}
-		}
-
-		LeafNodeType       * const * const mVelocityNodes;
-		openvdb::Vec3SGrid::Ptr gradientOfPressure;
-		double                       const mVoxelSize;
-	}; // class CorrectVelocityOp
-
-
-	   /// Constant boundary condition functor
-	struct DirichletOp {
-		inline void operator()(const openvdb::Coord&,
-			const openvdb::Coord&, double&, double& diag) const {
-			diag -= 1;
-		}
-	};
-
-
-	//template<typename VectorGridType>
-	inline bool
-		removeDivergence(openvdb::Vec3SGrid::Ptr velocityGrid, openvdb::Vec3SGrid::ConstPtr gradient_grid, openvdb::FloatGrid::ConstPtr external_divergencegrid, const int iterations, hvdb::Interrupter& interrupter)
-	{
-		typedef openvdb::Vec3SGrid::TreeType       myVectorTreeType;
-		typedef myVectorTreeType::LeafNodeType   myVectorLeafNodeType;
-		typedef openvdb::Vec3SGrid::ValueType      myVectorType;
-		typedef myVectorType::ValueType          myVectorElementType;
-
-		typedef openvdb::FloatGrid   myScalarGrid;
-		typedef openvdb::FloatGrid::TreeType                                               myScalarTree;
-
-		//openvdb::tools::Divergence<VectorGridType> divergenceOp(velocityGrid);
-		//typename ScalarGrid::Ptr divGrid = divergenceOp.process();
-		
-		
-		openvdb::FloatGrid::Ptr
-			external_divGrid = external_divergencegrid->deepCopy();
-		openvdb::FloatGrid::Grid::Ptr internal_divGrid = openvdb::FloatGrid::Grid::create(*velocityGrid);
-
-		std::string gridName = velocityGrid->getName();
-		// Iterate over all active values.
-	
-		
-	
-		openvdb::tools::transformValues(velocityGrid->cbeginValueOn(), *internal_divGrid, Diverge(velocityGrid->transform(), velocityGrid, gradient_grid));
-
-		openvdb::FloatGrid::Grid::Ptr external_divGrid_transformed = openvdb::FloatGrid::Grid::create(*internal_divGrid);
-		// Get the source and target grids' index space to world space transforms.
-		const openvdb::math::Transform
-			&sourceXform = external_divGrid->transform(),
-			&targetXform = external_divGrid_transformed->transform();
-		// Compute a source grid to target grid transform.
-		// (For this example, we assume that both grids' transforms are linear,
-		// so that they can be represented as 4 x 4 matrices.)
-		openvdb::Mat4R xform =
-			sourceXform.baseMap()->getAffineMap()->getMat4() *
-			targetXform.baseMap()->getAffineMap()->getMat4().inverse();
-		// Create the transformer.
-		openvdb::tools::GridTransformer transformer(xform);
-		// Resample using trilinear interpolation.
-		transformer.transformGrid<openvdb::tools::BoxSampler, openvdb::FloatGrid>(
-			*external_divGrid, *external_divGrid_transformed);
-		
-		// Prune the target tree for optimal sparsity.
-		external_divGrid_transformed->tree().prune();
-
-		openvdb::FloatGrid::Ptr diffDivergence = internal_divGrid->deepCopy();
-		// Define a local function that subtracts two floating-point values.
-		struct Local {
-			static inline void diff(const float& a, const float& b, float& result) {
-				result = a + b;
-			}
-		};
-		
-		// Compute the difference between corresponding voxels of aGrid and bGrid
-		// and store the result in aGrid, leaving bGrid empty.
-		diffDivergence->tree().combine(external_divGrid_transformed->tree(), Local::diff);
-		openvdb::math::pcg::State state = openvdb::math::pcg::terminationDefaults<myVectorElementType>();
-		state.iterations = iterations;
-		state.relativeError = state.absoluteError = openvdb::math::Delta<myVectorElementType>::value();
-
-		typedef openvdb::math::pcg::JacobiPreconditioner<openvdb::tools::poisson::LaplacianMatrix> PCT;
-
-		//openvdb::FloatTree::Ptr pressure =
-		//	openvdb::tools::poisson::solveWithBoundaryConditionsAndPreconditioner2D<PCT>(
-		//		diffDivergence->tree(), DirichletOp(),gradient_grid->tree(), state, interrupter);
-		openvdb::FloatTree::Ptr pressure =
-			openvdb::tools::poisson::solveWithBoundaryConditionsAndPreconditioner<PCT>(
-				diffDivergence->tree(), DirichletOp(), state, interrupter);
-
-
-		openvdb::FloatGrid::Ptr pressureGrid = openvdb::FloatGrid::create(pressure);
-		pressureGrid->setTransform(velocityGrid->transform().copy());
-
-		openvdb::tools::Gradient<openvdb::FloatGrid> gradientOp(*pressureGrid);
-		openvdb::Vec3SGrid::Ptr gradientOfPressure = gradientOp.process();
-
-		
-
-
-		// Iterate over all active values.
-		openvdb::tools::foreach(gradientOfPressure->beginValueOn(), ProjectVectorToSurface( gradient_grid, gradientOfPressure->transform(),/*keepLength=*/false), true, 0);
-
-		{
-			std::vector<myVectorLeafNodeType*> velocityNodes;
-			velocityGrid->tree().getNodes(velocityNodes);
-
-			std::vector<const myVectorLeafNodeType*> gradientNodes;
-			gradientNodes.reserve(velocityNodes.size());
-			gradientOfPressure->tree().getNodes(gradientNodes);
-
-			const double dx = velocityGrid->transform().voxelSize()[0];
-
-			tbb::parallel_for(tbb::blocked_range<size_t>(0, velocityNodes.size()),
-				CorrectVelocityOp<myVectorTreeType>(&velocityNodes[0], gradientOfPressure, dx));
-			
-			//openvdb::tools::foreach(velocityGrid->beginValueOn(), ProjectVectorToSurface(gradient_grid, velocityGrid->transform()), true, 0);
-
-			
-		}
-
-		return state.success;
-	}
-
-
-} // unnamed namespace
-
 OP_ERROR
 SOP_VdbRemove_Divergence::cookMySop(OP_Context& context)
 {
@@ -203,7 +47,21 @@ SOP_VdbRemove_Divergence::cookMySop(OP_Context& context)
 
 		hvdb::Interrupter boss("Removing Divergence");
 
-		const int iterations = evalInt("iterations", 0, time);
+		PressureSolveParms solveParms;
+		solveParms.iterations = evalInt("iterations", 0, time);
+		solveParms.laplacianMode = LAPLACIAN();
+		solveParms.preconditionerMode = PRECONDITIONER();
+		solveParms.matrixFree = MATRIXFREE() != 0;
+		solveParms.mixedPrecision = MIXEDPRECISION() != 0;
+		solveParms.refinementSteps = REFINEMENTS();
+		if (solveParms.mixedPrecision && !solveParms.matrixFree) {
+			addWarning(SOP_MESSAGE, "Mixed precision needs the matrix free solve, solving in double precision.");
+		}
+		const bool warmStart = WARMSTART();
+		const bool outputPressure = OUTPUTPRESSURE();
+		UT_String pressureNameStr;
+		evalString(pressureNameStr, "pressurename", 0, time);
+		const std::string pressureName = pressureNameStr.toStdString();
 
 		UT_String velocityGroupStr;
 		evalString(velocityGroupStr, "velocitygroup", 0, time);
@@ -263,6 +121,26 @@ SOP_VdbRemove_Divergence::cookMySop(OP_Context& context)
 			return error();
 		}
 
+		// previous pressure, optional
+		openvdb::FloatGrid::ConstPtr previous_pressure;
+		const GU_Detail* pressureGdp = warmStart ? inputGeo(3, context) : NULL;
+		if (pressureGdp) {
+			UT_String pressureGroupStr;
+			evalString(pressureGroupStr, "pressuregroup", 0, time);
+			const GA_PrimitiveGroup* pressureGroup = matchGroup(const_cast<GU_Detail&>(*pressureGdp), pressureGroupStr.toStdString());
+			for (hvdb::VdbPrimCIterator pIt(pressureGdp, pressureGroup); pIt; ++pIt) {
+				if (pIt->getGridName() != pressureName) continue;
+				previous_pressure = openvdb::gridConstPtrCast<openvdb::FloatGrid>(pIt->getConstGridPtr());
+				if (previous_pressure) break;
+			}
+			if (!previous_pressure) {
+				const std::string msg = "No float VDB named " + pressureName + " in the pressure input, starting from zero pressure.";
+				addWarning(SOP_MESSAGE, msg.c_str());
+			}
+		}
+
+		std::vector<openvdb::FloatGrid::Ptr> pressureGrids;
+
 		//process
 		for (hvdb::VdbPrimIterator vdbIt(gdp, velocityGroup); vdbIt; ++vdbIt) {
 
@@ -276,11 +154,31 @@ SOP_VdbRemove_Divergence::cookMySop(OP_Context& context)
 
 				//openvdb::Vec3fGrid& grid = static_cast<openvdb::Vec3fGrid&>(vdbIt->getGrid());
 				openvdb::Vec3fGrid::Ptr velocity_grid = openvdb::gridPtrCast<openvdb::Vec3fGrid>(vdbIt->getGridPtr());
-				if (!removeDivergence(velocity_grid, gradient_grid, divergence_grid, iterations, boss) && !boss.wasInterrupted()) {
+				bool preconditionerFallback = false;
+				openvdb::FloatGrid::Ptr pressure_grid;
+				if (!removeDivergence(velocity_grid, gradient_grid, divergence_grid, solveParms,
+					mPressureMatrix, preconditionerFallback, previous_pressure, outputPressure ? &pressure_grid : NULL, boss) && !boss.wasInterrupted()) {
 					const std::string msg = velocity_grid->getName() + " did not fully converge.";
 					addWarning(SOP_MESSAGE, msg.c_str());
 				}
+				if (preconditionerFallback) {
+					const std::string msg = velocity_grid->getName() + ": preconditioner is not available, used Jacobi instead.";
+					addWarning(SOP_MESSAGE, msg.c_str());
+				}
+				if (pressure_grid) pressureGrids.push_back(pressure_grid);
+			}
+		}
+
+		// one pressure per velocity grid, an older pressure of the same name in the first input is replaced
+		for (size_t n = 0; n < pressureGrids.size(); ++n) {
+			const std::string name = n == 0 ? pressureName : pressureName + std::to_string(n);
+			pressureGrids[n]->setName(name);
+			GU_PrimVDB* pressurePrim = NULL;
+			for (hvdb::VdbPrimIterator pIt(gdp); pIt; ++pIt) {
+				if (pIt->getGridName() == name) { pressurePrim = *pIt; break; }
 			}
+			if (pressurePrim) pressurePrim->setGrid(*pressureGrids[n]);
+			else hvdb::createVdbPrimitive(*gdp, pressureGrids[n], name.c_str());
 		}
 
 		if (!processedVDB && !boss.wasInterrupted()) {
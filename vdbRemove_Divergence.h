@@ -37,6 +37,7 @@
 #include <ParmFactory.h>
 #include <Utils.h>
 #include <Diverge.h>
+#include <PressureProjection.h>
 
 typedef openvdb::BoolGrid   ColliderMaskGrid; ///< @todo really should derive from velocity grid
 typedef openvdb::BBoxd      ColliderBBox;
@@ -80,6 +81,7 @@ private:
 
 
 namespace VdbCappucino {
+
 	class SOP_VdbRemove_Divergence : public openvdb_houdini::SOP_NodeVDB
 	{
 	public:
@@ -105,6 +107,15 @@ namespace VdbCappucino {
 		// helper function for returning value of parameter
 		int DEBUG() { return evalInt("debug", 0, 0); }
 		float DT() { return evalFloat("dt", 0, 0); }
+		int LAPLACIAN() { return evalInt("laplacian", 0, 0); }
+		int PRECONDITIONER() { return evalInt("preconditioner", 0, 0); }
+		int MATRIXFREE() { return evalInt("matrixfree", 0, 0); }
+		int MIXEDPRECISION() { return evalInt("mixedprecision", 0, 0); }
+		int REFINEMENTS() { return evalInt("refinements", 0, 0); }
+		int WARMSTART() { return evalInt("warmstart", 0, 0); }
+		int OUTPUTPRESSURE() { return evalInt("outputpressure", 0, 0); }
+
+		PressureMatrixCache mPressureMatrix;
 
 	};
 
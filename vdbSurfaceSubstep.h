@@ -0,0 +1,56 @@
+#pragma once
+#include <SOP/SOP_Node.h>
+#include <SOP_NodeVDB.h>
+#include <openvdb/Grid.h>
+#include <openvdb/tools/Morphology.h>
+#include <ClosestPoint.h>
+#include <Diverge.h>
+#include <PressureProjection.h>
+
+namespace VdbCappucino {
+
+	/// One or more substeps of the surface flow in a single node: CPT extension, Jacobian
+	/// coupling, projection onto the surface, divergence and pressure projection run back to back
+	/// on the velocity grid, the surface fields are looked up and resampled once per cook.
+	class SOP_VdbSurfaceSubstep : public openvdb_houdini::SOP_NodeVDB
+	{
+	public:
+		// node contructor for HDK
+		static OP_Node *myConstructor(OP_Network*, const char *, OP_Operator *);
+
+		// parameter array for Houdini UI
+		static PRM_Template myTemplateList[];
+
+	protected:
+		// constructor, destructor
+		SOP_VdbSurfaceSubstep(OP_Network *net, const char *name, OP_Operator *op);
+
+		virtual ~SOP_VdbSurfaceSubstep();
+
+		// labeling node inputs in Houdini UI
+		virtual const char *inputLabel(unsigned idx) const;
+
+		// main function that does geometry processing
+		virtual OP_ERROR cookMySop(OP_Context &context);
+
+	private:
+		// helper function for returning value of parameter
+		int DEBUG() { return evalInt("debug", 0, 0); }
+		int SUBSTEPS(fpreal t) { return evalInt("substeps", 0, t); }
+		fpreal MAXCELLS(fpreal t) { return evalFloat("maxcells", 0, t); }
+		int CPTINTERPOLATION() { return evalInt("cptinterpolation", 0, 0); }
+		int PRUNEBAND() { return evalInt("pruneband", 0, 0); }
+		int INTERPOLATION() { return evalInt("interpolation", 0, 0); }
+		int LAPLACIAN() { return evalInt("laplacian", 0, 0); }
+		int PRECONDITIONER() { return evalInt("preconditioner", 0, 0); }
+		int MATRIXFREE() { return evalInt("matrixfree", 0, 0); }
+		int MIXEDPRECISION() { return evalInt("mixedprecision", 0, 0); }
+		int REFINEMENTS() { return evalInt("refinements", 0, 0); }
+		int WARMSTART() { return evalInt("warmstart", 0, 0); }
+		int OUTPUTPRESSURE() { return evalInt("outputpressure", 0, 0); }
+
+		PressureMatrixCache mPressureMatrix;
+	};
+
+
+}
@@ -27,10 +27,14 @@ namespace VdbCappucino {
 		// helper function for returning value of parameter
 		int DEBUG() { return evalInt("debug", 0, 0); }
 		
-		fpreal DIM(int t) { return evalInt("dim", 0, t); }
+		int DIM(fpreal t) { return evalInt("dim", 0, t); }
+		fpreal SIGMA(fpreal t) { return evalFloat("sigma", 0, t); }
+		fpreal DK(fpreal t) { return evalFloat("dk", 0, t); }
+		fpreal ENDK(fpreal t) { return evalFloat("endk", 0, t); }
 		fpreal DT(fpreal t) { return evalFloat("dt", 0, t); }
 		fpreal GRAVITY(fpreal t) { return evalFloat("gravity", 0, t); }
 		fpreal ALPHA(fpreal t) { return evalFloat("alpha", 0, t); }
+		int MODE() { return evalInt("mode", 0, 0); }
 	};
 
 
@@ -1,5 +1,6 @@
 #pragma once
 #include <SOP/SOP_Node.h>
+#include <iWaveKernel.h>
 
 namespace VdbCappucino {
 	class SOP_VdbWaveKernel : public SOP_Node
@@ -26,11 +27,15 @@ namespace VdbCappucino {
 	private:
 		// helper function for returning value of parameter
 		int DEBUG() { return evalInt("debug", 0, 0); }
-		fpreal DIM(int t) { return evalInt("dim", 0, t); }
+		int DIM(fpreal t) { return evalInt("dim", 0, t); }
 		fpreal DK(fpreal t) { return evalFloat("dk", 0, t); }
 		fpreal ENDK(fpreal t) { return evalFloat("endk", 0, t); }
 		fpreal SIGMA(fpreal t) { return evalFloat("sigma", 0, t); }
 
+		// kernel of the last cook and the parameters it was built with
+		iWaveKernelParms mKernelParms;
+		openvdb::FloatTree::Ptr mKernelTree;
+
 	};
 
 